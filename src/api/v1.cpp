@@ -2,103 +2,26 @@
 #include "../client_connection.hpp"
 
 
-v1Conversation::Status v1Conversation::_handlePacket(nlohmann::json const & packet) {
-    std::array const handlers{
-        std::map<PacketType, TransitionFunc>{ // NONE
-            std::pair{ClientPacketType::PULSE, [&](nlohmann::json const &) {
-                return std::pair(Status::FINISHED, State::NONE);
-            }},
-
-            std::pair{ClientPacketType::PL_SEL, [&](nlohmann::json const & packet) {
-                std::string playlist = packet.at("name").get<std::string>();
-                if (_owner.playlistExists(playlist)) {
-                    _owner.selectPlaylist(playlist);
-                    sendSuccess();
-                    return std::pair(Status::FINISHED, State::NONE);
-
-                } else {
-                    nlohmann::json packet{
-                        {"type", ServerPacketType::STATUS},
-                        {"code", ServerStatuses::NOT_FOUND},
-                        {"msg", "Please enter a password to create the playlist with"}
-                    };
-                    sendPacket(packet);
-                    _playlist = playlist;
-                    return std::pair(Status::CONTINUING, State::PL_SEL);
-                }
-            }},
-
-            std::pair{ClientPacketType::PL_SUB, [&](nlohmann::json const & packet) {
-                packet.at("sub").get<bool>() ? _owner.subscribe() : _owner.unsubscribe();
-                sendSuccess();
-                return std::pair(Status::FINISHED, State::NONE);
-            }},
-
-            std::pair{ClientPacketType::MUS_ADD, [&](nlohmann::json const & packet) {
-                Music music(packet.at("url").get<std::string>());
-
-                // Parse options
-                std::map<std::string, std::string> options;
-                auto iter = packet.find("options");
-                if (iter != packet.end()) { // The `options` object is optional
-                    for (auto const & [key, value] : (*iter).items()) {
-                        music.setOption(key, value.get<std::string>());
-                    }
-                }
-
-                _owner.addMusic(music);
-                // Do not add to the queue if we're already subscribed (already adding musics)
-                if (!_owner.subscribed()) _owner.appendMusic(music);
-
-                sendSuccess();
-                return std::pair(Status::FINISHED, State::NONE);
-            }},
-
-            std::pair{ClientPacketType::POS_SET, [&](nlohmann::json const & packet) {
-                _owner.seek(packet.at("pos").get<double>());
-                sendSuccess();
-                return std::pair(Status::FINISHED, State::NONE);
-            }},
-
-            std::pair{ClientPacketType::PAUSE, [&](nlohmann::json const & packet) {
-                packet.at("stop").get<bool>() ? _owner.pause() : _owner.play();
-                sendSuccess();
-                return std::pair(Status::FINISHED, State::NONE);
-            }}
-        },
-
-
-        std::map<PacketType, TransitionFunc>{ // AUTH
-        },
-
-
-        std::map<PacketType, TransitionFunc>{ // PL_SEL
-            std::pair{ClientPacketType::PASSWORD, [&](nlohmann::json const & packet) {
-                std::string password = packet.at("pass").get<std::string>();
-                if (password.empty()) {
-                    nlohmann::json error{
-                        {"type", ServerPacketType::STATUS},
-                        {"code", ServerStatuses::BAD_PASS},
-                        {"msg", "A playlist cannot have an empty password"}
-                    };
-                    sendPacket(error);
-                    return std::pair(Status::CONTINUING, State::PL_SEL);
-                }
-
-                _owner.newPlaylist(_playlist, packet.at("pass").get<std::string>());
-                _owner.selectPlaylist(_playlist);
-                sendSuccess();
-                return std::pair(Status::FINISHED, State::NONE);
-            }}
-        },
-
-
-        std::map<PacketType, TransitionFunc>{ // PL_DEL
-        }
-    };
+v1Conversation::Transitions const v1Conversation::transitions = [](){
+    Transitions transitions{}; // Everything not listed below is rejected
+
+    transitions[State::NONE][ClientPacketType::PULSE]   = &v1Conversation::handlePulse;
+    transitions[State::NONE][ClientPacketType::PL_SEL]  = &v1Conversation::handlePlaylistSelection;
+    transitions[State::NONE][ClientPacketType::PL_SUB]  = &v1Conversation::handleSubscription;
+    transitions[State::NONE][ClientPacketType::MUS_ADD] = &v1Conversation::handleMusicAddition;
+    transitions[State::NONE][ClientPacketType::MUS_IMPORT] = &v1Conversation::handleMusicImport;
+    transitions[State::NONE][ClientPacketType::POS_SET] = &v1Conversation::handlePositionSetting;
+    transitions[State::NONE][ClientPacketType::PAUSE]   = &v1Conversation::handlePause;
+
+    transitions[State::PL_SEL][ClientPacketType::PASSWORD] = &v1Conversation::handlePlaylistPassword;
 
+    return transitions;
+}();
+
+
+v1Conversation::Status v1Conversation::_handlePacket(InboundPacket const & packet) {
     try {
-        return processStateMachine(handlers, packet.at("type").get<unsigned>(), packet);
+        return processStateMachine(transitions, packet.getUnsigned("type"), packet);
 
     } catch (StateMachineRejection const & e) {
         nlohmann::json packet{
@@ -109,6 +32,15 @@ v1Conversation::Status v1Conversation::_handlePacket(nlohmann::json const & pack
         sendPacket(packet);
         throw e;
 
+    } catch (InboundPacket::Error const & e) {
+        nlohmann::json packet{
+            {"type", ServerPacketType::STATUS},
+            {"code", ServerStatuses::REJECTED},
+            {"msg", e.what()}
+        };
+        sendPacket(packet);
+        throw e;
+
     } catch (nlohmann::json::exception const & e) {
         nlohmann::json packet{
             {"type", ServerPacketType::STATUS},
@@ -138,6 +70,129 @@ v1Conversation::Status v1Conversation::_handlePacket(nlohmann::json const & pack
 }
 
 
+v1Conversation::Transition v1Conversation::handlePulse(InboundPacket const & packet) {
+    // Clients using delta heartbeats ask for this when they notice a gap
+    if (packet.contains("resync") && packet.getBool("resync")) _owner.requestSnapshot();
+    return std::pair(Status::FINISHED, State::NONE);
+}
+
+v1Conversation::Transition v1Conversation::handlePlaylistSelection(InboundPacket const & packet) {
+    std::string playlist = packet.getStr("name");
+    if (_owner.playlistExists(playlist)) {
+        _owner.selectPlaylist(playlist);
+        sendSuccess();
+        return std::pair(Status::FINISHED, State::NONE);
+
+    } else if (_owner.trusted()) {
+        // Trusted clients aren't asked for a password, though one they set must be as valid as any
+        // other; without one, the playlist can't be unlocked by password at all
+        std::string password = packet.contains("pass") ? packet.getStr("pass") : "";
+        if (packet.contains("pass") && password.empty()) {
+            nlohmann::json error{
+                {"type", ServerPacketType::STATUS},
+                {"code", ServerStatuses::BAD_PASS},
+                {"msg", "A playlist cannot have an empty password"}
+            };
+            sendPacket(error);
+            return std::pair(Status::FINISHED, State::NONE);
+        }
+        _owner.newPlaylist(playlist, password);
+        _owner.selectPlaylist(playlist);
+        sendSuccess();
+        return std::pair(Status::FINISHED, State::NONE);
+
+    } else {
+        nlohmann::json packet{
+            {"type", ServerPacketType::STATUS},
+            {"code", ServerStatuses::NOT_FOUND},
+            {"msg", "Please enter a password to create the playlist with"}
+        };
+        sendPacket(packet);
+        _playlist = playlist;
+        return std::pair(Status::CONTINUING, State::PL_SEL);
+    }
+}
+
+v1Conversation::Transition v1Conversation::handleSubscription(InboundPacket const & packet) {
+    packet.getBool("sub") ? _owner.subscribe() : _owner.unsubscribe();
+    sendSuccess();
+    return std::pair(Status::FINISHED, State::NONE);
+}
+
+static void setOptions(Music & music, nlohmann::json const & options) {
+    for (auto const & [key, value] : options.items()) {
+        music.setOption(key, value.get<std::string>());
+    }
+}
+
+v1Conversation::Transition v1Conversation::handleMusicAddition(InboundPacket const & packet) {
+    Music music(packet.getStr("url"));
+
+    // Parse options
+    if (packet.contains("options")) { // The `options` object is optional
+        // This is rare enough that the full tree can be afforded
+        setOptions(music, packet.json().at("options"));
+    }
+
+    _owner.addMusic(music);
+    // Do not add to the queue if we're already subscribed (already adding musics)
+    if (!_owner.subscribed()) {
+        _owner.appendMusic(music, replyOnCompletion());
+    } else {
+        sendSuccess();
+    }
+    return std::pair(Status::FINISHED, State::NONE);
+}
+
+v1Conversation::Transition v1Conversation::handleMusicImport(InboundPacket const & packet) {
+    // Each entry is shaped like a `MUS_ADD`; imports are rare, so the full tree can be afforded
+    nlohmann::json const & entries = packet.json().at("musics");
+    std::vector<Music> musics;
+    musics.reserve(entries.size());
+    for (nlohmann::json const & entry : entries) {
+        Music & music = musics.emplace_back(entry.at("url").get<std::string>());
+        if (entry.contains("options")) setOptions(music, entry.at("options"));
+    }
+
+    // Everything is added at once, rather than taking the manager's lock for each music
+    _owner.addMusics(musics);
+    sendSuccess();
+    return std::pair(Status::FINISHED, State::NONE);
+}
+
+v1Conversation::Transition v1Conversation::handlePositionSetting(InboundPacket const & packet) {
+    _owner.seek(packet.getDouble("pos"), replyOnCompletion());
+    return std::pair(Status::FINISHED, State::NONE);
+}
+
+v1Conversation::Transition v1Conversation::handlePause(InboundPacket const & packet) {
+    if (packet.getBool("stop")) {
+        _owner.pause(replyOnCompletion());
+    } else {
+        _owner.play(replyOnCompletion());
+    }
+    return std::pair(Status::FINISHED, State::NONE);
+}
+
+v1Conversation::Transition v1Conversation::handlePlaylistPassword(InboundPacket const & packet) {
+    std::string password = packet.getStr("pass");
+    if (password.empty()) {
+        nlohmann::json error{
+            {"type", ServerPacketType::STATUS},
+            {"code", ServerStatuses::BAD_PASS},
+            {"msg", "A playlist cannot have an empty password"}
+        };
+        sendPacket(error);
+        return std::pair(Status::CONTINUING, State::PL_SEL);
+    }
+
+    _owner.newPlaylist(_playlist, password);
+    _owner.selectPlaylist(_playlist);
+    sendSuccess();
+    return std::pair(Status::FINISHED, State::NONE);
+}
+
+
 void v1Conversation::sendTimeout() {
     nlohmann::json packet{
         {"type", ServerPacketType::STATUS},
@@ -146,15 +201,29 @@ void v1Conversation::sendTimeout() {
     sendPacket(packet);
 }
 
-void v1Conversation::heartbeat(nlohmann::json const & status) {
+nlohmann::json v1Conversation::heartbeatPacket(nlohmann::json const & status) {
+    // Heartbeats are one-off messages, so they all bear the same ID
     nlohmann::json packet{
+        {"id", -1},
         {"type", ServerPacketType::PULSE},
+        {"seq", status["seq"]},
         {"duration", status["duration"]},
         {"pause", status["pause"]},
         {"playlist", status["playlist"]},
         {"position", status["position"]}
     };
-    sendPacket(packet);
+    return packet;
+}
+
+nlohmann::json v1Conversation::heartbeatDeltaPacket(nlohmann::json const & delta) {
+    nlohmann::json packet{
+        {"id", -1},
+        {"type", ServerPacketType::PULSE_DELTA},
+        {"seq", delta["seq"]},
+        {"changes", delta["changes"]},
+        {"queue", delta["queue"]}
+    };
+    return packet;
 }
 
 void v1Conversation::sendSuccess() {
@@ -164,3 +233,14 @@ void v1Conversation::sendSuccess() {
     };
     sendPacket(packet);
 }
+
+ClientConnection::Completion v1Conversation::replyOnCompletion() const {
+    return [id = id()](ClientConnection & owner, bool success) {
+        nlohmann::json packet{
+            {"type", ServerPacketType::STATUS},
+            {"code", success ? ServerStatuses::OK : ServerStatuses::ERROR}
+        };
+        if (!success) packet["msg"] = "The player failed to execute the command";
+        sendPacket(owner, id, packet);
+    };
+}
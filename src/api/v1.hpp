@@ -23,7 +23,9 @@ public:
             MUS_SKIP,    // Music removal from queue
             VOL_SET,     // Volume setting
             POS_SET,     // Playback position setting
-            PAUSE        // (Un)pausing
+            PAUSE,       // (Un)pausing
+
+            NB_TYPES     // Not a packet type, must stay last
         };
     };
     struct ServerPacketType {
@@ -33,7 +35,8 @@ public:
             AUTH_SALT,   // Authentication salt
             USER_LIST,   // User list
             PL_LIST,     // Playlist list
-            MUS_LIST     // Playlist contents
+            MUS_LIST,    // Playlist contents
+            PULSE_DELTA  // Status report changes since the previous one (if negotiated)
         };
     };
 
@@ -42,7 +45,9 @@ public:
             NONE,
             AUTH,
             PL_SEL,
-            PL_DEL
+            PL_DEL,
+
+            NB_STATES    // Not a state, must stay last
         };
     };
 
@@ -61,16 +66,43 @@ public:
     };
 
 private:
+    using Transitions = TransitionTable<v1Conversation, State::NB_STATES, ClientPacketType::NB_TYPES>;
+    static Transitions const transitions;
+
     std::string _playlist;
 
 public:
+    static InboundPacket::Format constexpr format = InboundPacket::Format::JSON;
+
     v1Conversation(ClientConnection & owner, int id) : Conversation(owner, id) {}
 
-    Status _handlePacket(nlohmann::json const & packet) override;
+    Status _handlePacket(InboundPacket const & packet) override;
+    void _reset() override { _playlist.clear(); }
     void sendTimeout() override;
-    void heartbeat(nlohmann::json const & status) override;
+    static std::string heartbeat(nlohmann::json const & status) {
+        return frame(heartbeatPacket(status));
+    }
+    static std::string heartbeatDelta(nlohmann::json const & delta) {
+        return frame(heartbeatDeltaPacket(delta));
+    }
+    static std::string frame(nlohmann::json const & packet) { return packet.dump(); }
+protected: // Used by later versions, which only change the encoding
+    static nlohmann::json heartbeatPacket(nlohmann::json const & status);
+    static nlohmann::json heartbeatDeltaPacket(nlohmann::json const & delta);
 private:
+    // State machine transitions
+    Transition handlePulse(InboundPacket const & packet);
+    Transition handlePlaylistSelection(InboundPacket const & packet);
+    Transition handleSubscription(InboundPacket const & packet);
+    Transition handleMusicAddition(InboundPacket const & packet);
+    Transition handleMusicImport(InboundPacket const & packet);
+    Transition handlePositionSetting(InboundPacket const & packet);
+    Transition handlePause(InboundPacket const & packet);
+    Transition handlePlaylistPassword(InboundPacket const & packet);
+
     void sendSuccess();
+    // Sends the STATUS reply once a player command is done, even if this has been destroyed
+    ClientConnection::Completion replyOnCompletion() const;
 };
 
 
@@ -0,0 +1,17 @@
+#include <arpa/inet.h>
+
+#include <cstring>
+
+#include "../client_connection.hpp"
+
+
+std::string v2Conversation::frame(nlohmann::json const & packet) {
+    // Leave room for the size, which is only known once the packet is serialized
+    uint32_t size;
+    std::string data(sizeof(size), '\0');
+    nlohmann::json::to_msgpack(packet, data);
+
+    size = htonl(data.size() - sizeof(size));
+    std::memcpy(data.data(), &size, sizeof(size));
+    return data;
+}
@@ -0,0 +1,23 @@
+#ifndef API_V2_HPP
+#define API_V2_HPP
+
+
+// Same packets and semantics as v1, but encoded in MessagePack, and length-prefixed instead of
+// NUL-terminated, which makes both ends cheaper
+class v2Conversation : public v1Conversation {
+public:
+    static InboundPacket::Format constexpr format = InboundPacket::Format::MESSAGEPACK;
+
+    v2Conversation(ClientConnection & owner, int id) : v1Conversation(owner, id) {}
+
+    static std::string heartbeat(nlohmann::json const & status) {
+        return frame(heartbeatPacket(status));
+    }
+    static std::string heartbeatDelta(nlohmann::json const & delta) {
+        return frame(heartbeatDeltaPacket(delta));
+    }
+    static std::string frame(nlohmann::json const & packet);
+};
+
+
+#endif
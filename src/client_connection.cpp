@@ -1,17 +1,18 @@
 
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <poll.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 
-#include <cerrno>
-#include <array>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <optional>
 #include <set>
 #include <spdlog/spdlog.h>
-#include <sstream>
 #include <stdexcept>
 
 #include "client_connection.hpp"
+#include "event_loop.hpp"
 
 
 using namespace std::literals::chrono_literals;
@@ -19,20 +20,20 @@ std::chrono::steady_clock::duration const ClientConnection::timeout = 10s;
 std::chrono::steady_clock::duration const ClientConnection::Conversation::timeout = 3s;
 
 
-ClientConnection::ClientConnection(int socket, Server & server, Server::ConnectionID id)
- : _socket(socket), _server(server), _id(id),
-   _pending(), _version(0), _conversations(), _lastActive(std::chrono::steady_clock::now()),
-   _playlistName(""), _subscribed(false),
-   _destructing(false), _running(true), _stopping(false), _thread([&](){run();}) {}
+ClientConnection::ClientConnection(int socket, Server & server, EventLoop & loop, bool trusted,
+                                   Transport transport, Server::ConnectionID id)
+ : _socket(socket), _server(server), _loop(loop), _trusted(trusted), _transport(transport), _id(id),
+   _recvBuffer(InboundPacket::padding), _recvStart(0), _recvEnd(0), _recvScanned(0),
+   _format(InboundPacket::Format::JSON), _version(0), _deltaHeartbeats(false), _needsSnapshot(true),
+   _conversations(), _spareConversations(),
+   _timeout([this](){ _loop.dispatch(*this, [this](){ stop(); }); }),
+   _playlistName(""), _subscribed(false), _stopping(false) {
+    _loop.timers().schedule(_timeout, timeout);
+}
 
 ClientConnection::~ClientConnection() {
-    _destructing = true;
-
     spdlog::get("logger")->trace("Stopping connection {}...", _id);
 
-    stop();
-    _thread.join();
-
     close(_socket);
     unsubscribe();
 
@@ -41,119 +42,186 @@ ClientConnection::~ClientConnection() {
 
 
 void ClientConnection::stop() {
-    _stopping = true;
+    // Only request destruction once
+    if (!_stopping) {
+        _stopping = true;
+        _loop.addWishToDie(_id);
+    }
 }
 
 
-void ClientConnection::run() {
-    std::array pollfds{
-        (struct pollfd){ .fd = _socket, .events = POLLIN | POLLRDHUP, .revents = 0 }
-    };
-    std::array<void (ClientConnection::*)(struct pollfd const &), pollfds.size()> handlers{
-        &ClientConnection::handleConnection
-    };
-    while (!_stopping) {
-        try {
-            switch (poll(pollfds.data(), pollfds.size(), 100)) {
-                case -1:
-                    spdlog::get("logger")->error("ClientConnection[{}].run() poll() error: {}",
-                                                 _id, strerror(errno));
-                    // fallthrough
-
-                case 0:
-                    break;
-
-                default:
-                    for (unsigned i = 0; i < pollfds.size(); ++i) {
-                        if (pollfds[i].revents & POLLERR) {
-                            spdlog::get("logger")->error("ClientConnection[{}].run(): file descr {} [pollfd index {}] returned error", _id, pollfds[i].fd, i);
-                        }
-                        if (pollfds[i].revents & (pollfds[i].events | POLLHUP)) {
-                            (this->*handlers[i])(pollfds[i]);
-                        }
-                    }
-            }
+void ClientConnection::handleHangup() {
+    spdlog::get("logger")->info("ClientConnection[{}] closed by peer", _id);
+    stop();
+}
 
-            // Terminate conversations that have timed out
-            auto iter = _conversations.cbegin();
-            while (iter != _conversations.cend()) {
-                auto cur = iter;
-                ++iter; // Get the next one now, since erasing invalidates `cur`
-                if (std::get<1>(*cur)->hasTimedOut()) {
-                    spdlog::get("logger")->error("ClientConnection[{}] conv {} timed out",
-                                                 _id, std::get<0>(*cur));
-                    std::get<1>(*cur)->sendTimeout();
-                    _conversations.erase(cur);
-                }
-            }
+void ClientConnection::handleTimeout(Conversation & conversation) {
+    _loop.dispatch(*this, [&](){
+        spdlog::get("logger")->error("ClientConnection[{}] conv {} timed out",
+                                     _id, conversation.id());
+        conversation.sendTimeout();
+        endConversation(std::find_if(_conversations.begin(), _conversations.end(),
+                                     [&](auto const & conv){ return conv.get() == &conversation; }));
+    });
+}
 
-            // Terminate ourselves if we timed out
-            if (hasTimedOut()) {
-                stop();
-            }
+std::pair<char *, std::size_t> ClientConnection::receiveBuffer() {
+    if (_recvBuffer.size() - InboundPacket::padding - _recvEnd < BUFSIZ) {
+        // Move the partial packet to the front, and only grow if that didn't make enough room
+        if (_recvStart != 0) {
+            std::memmove(_recvBuffer.data(), &_recvBuffer[_recvStart], _recvEnd - _recvStart);
+            _recvEnd -= _recvStart;
+            _recvStart = 0;
+        }
+        if (_recvBuffer.size() - InboundPacket::padding - _recvEnd < BUFSIZ) {
+            _recvBuffer.resize(std::max(_recvBuffer.size() * 2,
+                                        _recvEnd + BUFSIZ + InboundPacket::padding));
+        }
+    }
+    // The parser may read past the end of the last packet, so that part is never handed out
+    return std::pair(&_recvBuffer[_recvEnd], _recvBuffer.size() - InboundPacket::padding - _recvEnd);
+}
 
-        } catch (std::exception const & e) {
-            spdlog::get("logger")->error("ClientConnection[{}].run(): Exception at top level: {}", _id, e.what());
-            stop();
-        } catch (...) {
-            spdlog::get("logger")->error("ClientConnection[{}].run(): Unknown exception at top level", _id);
+void ClientConnection::handleReceived(std::size_t size) {
+    _recvEnd += size;
+
+    // The format may change after each packet (i.e. the negotiation), so it's checked every time
+    while (_recvStart != _recvEnd) {
+        std::string_view frame;
+        std::size_t consumed = _transport == Transport::STREAM ? findFrame(frame)
+                                                               : findWebSocketFrame(frame);
+
+        if (frame.size() > _server.maxFrameSize()) {
+            spdlog::get("logger")->error("ClientConnection[{}] sent a packet larger than {} bytes, closing",
+                                         _id, _server.maxFrameSize());
             stop();
+            _recvStart = _recvEnd = _recvScanned = 0;
+            return;
+        }
+        // If the packet is incomplete, do not try to parse
+        if (consumed == 0) break;
+
+        // Try deserializing the object, straight from the buffer
+        std::optional<InboundPacket> packet;
+        try {
+            packet.emplace(frame.data(), frame.data() + frame.size(), _format);
+        } catch (InboundPacket::Error const & e) {
+            spdlog::get("logger")->trace("ClientConnection[{}] recieved malformed packet: {}", _id, e.what());
         }
+        if (packet) handlePacket(*packet);
+        // Skip the packet just read, plus its framing
+        _recvStart += consumed;
+        _recvScanned = 0;
     }
-    _running = false;
 
-    requestDestruction();
+    // Data is usually consumed entirely, so this avoids having to move anything around later
+    if (_recvStart == _recvEnd) {
+        _recvStart = _recvEnd = 0;
+    }
 }
 
-void ClientConnection::requestDestruction() {
-    // Do not register for destruction if we're already destructing
-    if (!_destructing) {
-        _server.addWishToDie(_id);
+std::size_t ClientConnection::findFrame(std::string_view & frame) {
+    char const * begin = &_recvBuffer[_recvStart];
+    std::size_t length = _recvEnd - _recvStart;
+
+    switch (_format) {
+        case InboundPacket::Format::JSON: {
+            // `memchr` is vectorized, unlike a byte-by-byte search
+            char const * end = static_cast<char const *>(
+                std::memchr(begin + _recvScanned, '\0', length - _recvScanned)
+            );
+            if (!end) {
+                _recvScanned = length;
+                frame = std::string_view(begin, length);
+                return 0;
+            }
+            frame = std::string_view(begin, end - begin);
+            return frame.size() + 1;
+        }
+
+        case InboundPacket::Format::MESSAGEPACK: {
+            // No scanning needed, the size is known as soon as the header is there
+            uint32_t size;
+            if (length < sizeof(size)) return 0;
+            std::memcpy(&size, begin, sizeof(size));
+            frame = std::string_view(begin + sizeof(size), ntohl(size));
+            return length < sizeof(size) + frame.size() ? 0 : sizeof(size) + frame.size();
+        }
     }
+    return 0;
 }
 
-void ClientConnection::handleConnection(struct pollfd const & fd) {
-    bool terminate = false; // Set this to request closing the connection
-
-    if (fd.revents & POLLIN) { // Incoming data!
-        std::stringstream s;
-        std::array<char, BUFSIZ> buffer;
-        ssize_t size = recv(_socket, buffer.data(), buffer.size(), 0);
-        if (size == -1) {
-            spdlog::get("logger")->error("ClientConnection[{}] recv() error: {}", _id,
-                                         strerror(errno));
-        } else if (size != 0) { // size == 0 happens when connection gets closed
-            std::string_view readBuf(buffer.data(), std::min(size, (ssize_t)BUFSIZ));
-
-            while (true) {
-                auto offset = readBuf.find('\0');
-                // Append fragment to previous fragment (if there's anything to append)
-                if (offset) _pending.append(readBuf.data(), std::min(offset, readBuf.size()));
-                // If no terminator was found, do not try to parse
-                if (offset == readBuf.npos) break;
-                // Skip the characters just read, plus the `\0`
-                readBuf.remove_prefix(offset + 1);
-                // Try deserializing the object
-                try {
-                    nlohmann::json packet = nlohmann::json::parse(_pending);
-                    handlePacket(packet);
-                } catch (nlohmann::json::parse_error const & e) {
-                    spdlog::get("logger")->trace("ClientConnection[{}] recieved malformed JSON: {}", _id, e.what());
-                }
-                // Reset buffer
-                _pending.clear();
+std::size_t ClientConnection::findWebSocketFrame(std::string_view & frame) try {
+    // Loop until a message is found, handling what isn't one
+    while (!_stopping) {
+        char * begin = &_recvBuffer[_recvStart];
+        std::size_t length = _recvEnd - _recvStart;
+
+        std::size_t consumed;
+        if (_transport == Transport::WEBSOCKET_HANDSHAKE) {
+            consumed = WebSocket::findHandshake(std::string_view(begin, length), _recvScanned);
+            frame = std::string_view(begin, consumed == 0 ? length : consumed);
+            if (consumed == 0) return 0;
+
+            _loop.send(*this, std::make_shared<std::string const>(WebSocket::handshake(frame)));
+            _transport = Transport::WEBSOCKET;
+            spdlog::get("logger")->trace("ClientConnection[{}] upgraded to WebSocket", _id);
+        } else {
+            WebSocket::Opcode opcode;
+            consumed = WebSocket::findFrame(begin, length, opcode, frame);
+            if (consumed == 0) return 0;
+            if (opcode == WebSocket::Opcode::TEXT || opcode == WebSocket::Opcode::BINARY) {
+                return consumed;
             }
+            handleControlFrame(opcode, frame);
         }
+        _recvStart += consumed;
+        _recvScanned = 0;
     }
+    frame = std::string_view();
+    return 0;
+} catch (WebSocket::Error const & e) {
+    spdlog::get("logger")->error("ClientConnection[{}] broke the WebSocket protocol, closing: {}",
+                                 _id, e.what());
+    // A client that didn't complete the handshake doesn't speak WebSocket yet
+    _loop.send(*this, std::make_shared<std::string const>(
+        _transport == Transport::WEBSOCKET ? WebSocket::closeFrame(e.code())
+                                           : std::string(WebSocket::badRequest)
+    ));
+    stop();
+    frame = std::string_view();
+    return 0;
+}
 
-    if (fd.revents & (POLLRDHUP | POLLHUP)) {
-        // Peer closed connection
-        spdlog::get("logger")->info("ClientConnection[{}] closed by peer", _id);
-        terminate = true;
+void ClientConnection::handleControlFrame(WebSocket::Opcode opcode, std::string_view payload) {
+    switch (opcode) {
+        case WebSocket::Opcode::PING:
+            // Keepalives from the client count as activity, like any packet
+            _loop.send(*this, std::make_shared<std::string const>(
+                WebSocket::frame(WebSocket::Opcode::PONG, payload)
+            ));
+            _loop.timers().schedule(_timeout, timeout);
+            break;
+        case WebSocket::Opcode::CLOSE:
+            // Echo the status code, as the closing handshake requires; the connection ends there
+            spdlog::get("logger")->info("ClientConnection[{}] closed by peer", _id);
+            _loop.send(*this, std::make_shared<std::string const>(
+                WebSocket::frame(WebSocket::Opcode::CLOSE, payload.substr(0, 2))
+            ));
+            stop();
+            break;
+        default: // Unsolicited pongs are allowed, and ignored
+            break;
     }
+}
 
-    if (terminate) {
-        stop();
+void ClientConnection::handleData(std::string_view data) {
+    while (!data.empty() && !_stopping) {
+        auto [buffer, room] = receiveBuffer();
+        std::size_t size = std::min(room, data.size());
+        std::memcpy(buffer, data.data(), size);
+        handleReceived(size);
+        data.remove_prefix(size);
     }
 }
 
@@ -164,8 +232,19 @@ public:
     using Key         = unsigned;
     using ReturnType  = std::unique_ptr<ClientConnection::Conversation>;
 
+    struct Handlers {
+        ReturnType (*create)(ClientConnection & owner, int id);
+        // Handles a one-off message with a conversation that only lives for this call
+        ClientConnection::Conversation::Status (*handleOneOff)(ClientConnection & owner, int id,
+                                                               InboundPacket const & packet);
+        std::string (*heartbeat)(nlohmann::json const & status);
+        std::string (*heartbeatDelta)(nlohmann::json const & delta);
+        std::string (*frame)(nlohmann::json const & packet); // Serializes a packet for the wire
+        InboundPacket::Format format;
+    };
+
 private:
-    std::map<Key, ReturnType(*)(ClientConnection & owner, int id)> _map;
+    std::map<Key, Handlers> _map;
 
 public:
     template<typename... Ps>
@@ -176,8 +255,13 @@ public:
 private:
     template<typename K, template<typename> class H, typename V, typename... Ps>
     void insertAll(K&& k, H<V>, Ps&&... ps) {
-        _map.insert({std::forward<K>(k), [](ClientConnection & owner, int id){
-            return ReturnType{std::make_unique<V>(owner, id)};
+        _map.insert({std::forward<K>(k), Handlers{
+            [](ClientConnection & owner, int id){ return ReturnType{std::make_unique<V>(owner, id)}; },
+            [](ClientConnection & owner, int id, InboundPacket const & packet){
+                V conversation(owner, id);
+                return conversation.handlePacket(packet);
+            },
+            &V::heartbeat, &V::heartbeatDelta, &V::frame, V::format
         }});
         insertAll(std::forward<Ps>(ps)...);
     }
@@ -196,51 +280,53 @@ template<typename T> struct APIVersion {};
 static APIMappings const packetHandlers{
     // Note: this should never have a key of "0"
     1, APIVersion<v1Conversation>{},
-    // 2, APIVersion<v2Conversation>{},
+    2, APIVersion<v2Conversation>{},
     // etc
 };
 
-void ClientConnection::handlePacket(nlohmann::json const & packet) try {
-    spdlog::get("logger")->trace("ClientConnection[{}] (version={}) recieved json {}",
-                                 _id, _version, packet.dump());
+void ClientConnection::handlePacket(InboundPacket const & packet) try {
+    if (spdlog::get("logger")->should_log(spdlog::level::trace)) { // Dumping may be expensive
+        spdlog::get("logger")->trace("ClientConnection[{}] (version={}) recieved json {}",
+                                     _id, _version, packet.dump());
+    }
     if (_version == 0) {
-        // Negotiating API version
-        if (!packet.is_array()) {
+        // Negotiating API version; this only happens once, so the full tree is fine
+        nlohmann::json const & versions = packet.json();
+        if (!versions.is_array()) {
             spdlog::get("logger")->error("ClientConnection[{}] expected API version array, rejecting", _id);
             return;
         }
-        handleNegotiation(packet);
+        handleNegotiation(versions);
         // If the negotiation failed, close the connection
         if (_version == 0) stop();
 
     } else {
         // Parse ID field to assign this to the correct conversation
-        if (!packet.is_object()) {
+        if (!packet.isObject()) {
             spdlog::get("logger")->error("ClientConnection[{}] expected object, rejecting",
                                          _id);
             return;
         }
 
-        int id = packet.at("id");
+        int id = packet.getInt("id");
         try {
             if (id < 0) {
                 // One-off message
-                packetHandlers.at(_version)(*this, id)->handlePacket(packet);
+                packetHandlers.at(_version).handleOneOff(*this, id, packet);
             } else {
                 // Check if the conversation exists
-                auto conversation = _conversations.find(id);
+                auto conversation = std::find_if(_conversations.begin(), _conversations.end(),
+                                                 [&](auto const & conv){ return conv->id() == id; });
                 if (conversation == _conversations.end()) {
-                    conversation = std::get<0>(_conversations.emplace(
-                        std::piecewise_construct,
-                        std::tuple(id), std::tuple(packetHandlers.at(_version)(*this, id))
-                    ));
+                    startConversation(id);
+                    conversation = std::prev(_conversations.end());
                 }
-                if (_conversations[id]->handlePacket(packet) == Conversation::Status::FINISHED) {
-                    _conversations.erase(id);
+                if ((*conversation)->handlePacket(packet) == Conversation::Status::FINISHED) {
+                    endConversation(conversation);
                 }
             }
 
-            _lastActive = std::chrono::steady_clock::now();
+            _loop.timers().schedule(_timeout, timeout);
 
         } catch (Conversation::StateMachineRejection const & e) {
             spdlog::get("logger")->error("ClientConnection[{}] conv {}: {}", _id, id, e.what());
@@ -248,6 +334,31 @@ void ClientConnection::handlePacket(nlohmann::json const & packet) try {
     }
 } catch (nlohmann::json::exception const & e) {
     spdlog::get("logger")->error("ClientConnection[{}] got JSON error while using packet, rejecting: {}", _id, e.what());
+} catch (InboundPacket::Error const & e) {
+    spdlog::get("logger")->error("ClientConnection[{}] got JSON error while using packet, rejecting: {}", _id, e.what());
+}
+
+
+ClientConnection::Conversation & ClientConnection::startConversation(int id) {
+    if (_spareConversations.empty()) {
+        _conversations.emplace_back(packetHandlers.at(_version).create(*this, id));
+    } else {
+        _conversations.emplace_back(std::move(_spareConversations.back()));
+        _spareConversations.pop_back();
+        _conversations.back()->reset(id);
+    }
+
+    Conversation & conversation = *_conversations.back();
+    _loop.timers().schedule(conversation._timeout, Conversation::timeout);
+    return conversation;
+}
+
+void ClientConnection::endConversation(decltype(_conversations)::iterator conversation) {
+    (*conversation)->_timeout.cancel();
+    // Order doesn't matter, so swap with the last one instead of shifting everything
+    _spareConversations.push_back(std::move(*conversation));
+    *conversation = std::move(_conversations.back());
+    _conversations.pop_back();
 }
 
 
@@ -268,38 +379,114 @@ void ClientConnection::handleNegotiation(nlohmann::json const & packet) {
     }
 
     // Construct the sorted set of requested API versions (from the JSON)
+    // Strings in the array are requests for optional capabilities
     std::set<unsigned> requested;
+    std::set<std::string> capabilities;
     for (auto const & version : packet) {
-        if (!version.is_number_unsigned()) {
-            spdlog::get("logger")->error("ClientConnection[{}] got malformed API array (expected only unsigned ints)");
+        if (version.is_number_unsigned()) {
+            requested.insert(version.get<unsigned>());
+        } else if (version.is_string()) {
+            capabilities.insert(version.get<std::string>());
+        } else {
+            spdlog::get("logger")->error("ClientConnection[{}] got malformed API array (expected only unsigned ints and strings)", _id);
             return;
         }
-        requested.insert(version.get<unsigned>());
     }
 
     // Find the largest common element, and send that
-    _version = mostRecentSharedVersion(supported, requested);
-    spdlog::get("logger")->trace("ClientConnection[{}] selected version {}", _id, _version);
-    sendPacket(nlohmann::json(_version)); // Sends a 0 in case of failure, notifying the client
+    unsigned version = mostRecentSharedVersion(supported, requested);
+    spdlog::get("logger")->trace("ClientConnection[{}] selected version {}", _id, version);
+    // Heartbeats are infrequent when nothing changes, so don't leave the client waiting for one
+    if (version != 0) _server.requestStatusReport();
+
+    // If any capabilities were requested, reply with the version followed by the granted ones
+    // Otherwise, send the version alone; a 0 in case of failure notifies the client
+    nlohmann::json reply = nlohmann::json(version);
+    if (!capabilities.empty()) {
+        reply = nlohmann::json::array({version});
+        if (version != 0 && capabilities.find("delta") != capabilities.end()) {
+            _deltaHeartbeats = true;
+            reply.push_back("delta");
+        }
+    }
+    // The client can't know the version's format yet, so the reply is always JSON
+    sendPacket(reply);
+
+    _version = version;
+    if (_version != 0) _format = packetHandlers.at(_version).format;
 }
 
 
 void ClientConnection::sendPacket(nlohmann::json const & packet) {
-    std::string const data = packet.dump();
-    if (send(_socket, data.data(), data.size(), MSG_NOSIGNAL) == -1) {
-        spdlog::get("logger")->error("ClientConnection[{}] send() error: {}", _id,
-                                     strerror(errno));
+    // Until the version is negotiated, everything is JSON
+    std::string data = _version == 0 ? packet.dump() : packetHandlers.at(_version).frame(packet);
+    if (_transport == Transport::WEBSOCKET) data = toWebSocket(data, _format);
+    _loop.send(*this, std::make_shared<std::string const>(std::move(data)));
+}
 
-        if (errno == EPIPE) {
-            // If the connection suffers a broken pipe (= timeout), kill it
-            stop();
+std::string ClientConnection::toWebSocket(std::string const & data, InboundPacket::Format format) {
+    switch (format) {
+        case InboundPacket::Format::JSON:
+            return WebSocket::frame(WebSocket::Opcode::TEXT, data);
+        case InboundPacket::Format::MESSAGEPACK:
+            // The message already delimits the packet, so its size prefix is dropped
+            return WebSocket::frame(WebSocket::Opcode::BINARY, std::string_view(data).substr(4));
+    }
+    return data;
+}
+
+Player::Completion ClientConnection::onLoop(Completion done) const {
+    // The connection may be gone by the time the player is done, so only capture how to find it
+    return [&loop = _loop, id = _id, done = std::move(done)](int error) {
+        loop.post([&loop, id, done, error](){
+            ClientConnection * connection = loop.connection(id);
+            if (connection) done(*connection, error >= 0);
+        });
+    };
+}
+
+ClientConnection::Heartbeats ClientConnection::serializeHeartbeats(nlohmann::json const & status,
+                                                                   nlohmann::json const & delta,
+                                                                   bool webSocket) {
+    Heartbeats heartbeats;
+    for (auto const & [version, handlers] : packetHandlers) {
+        Heartbeat heartbeat{
+            std::make_shared<std::string const>(handlers.heartbeat(status)),
+            std::make_shared<std::string const>(handlers.heartbeatDelta(delta)),
+            nullptr, nullptr
+        };
+        // Wrapped once here, rather than for each WebSocket client
+        if (webSocket) {
+            heartbeat.webSocketSnapshot = std::make_shared<std::string const>(
+                toWebSocket(*heartbeat.snapshot, handlers.format)
+            );
+            heartbeat.webSocketDelta = std::make_shared<std::string const>(
+                toWebSocket(*heartbeat.delta, handlers.format)
+            );
         }
+        heartbeats.emplace(version, std::move(heartbeat));
     }
+    return heartbeats;
 }
 
-void ClientConnection::heartbeat(nlohmann::json const & status) {
+void ClientConnection::heartbeat(Heartbeats const & heartbeats) {
     if (_version == 0) return; // Don't send heartbeats to connections not initialized yet
-    packetHandlers.at(_version)(*this, -1)->heartbeat(status);
+    Heartbeat const & heartbeat = heartbeats.at(_version);
+    bool const webSocket = _transport == Transport::WEBSOCKET;
+    // A heartbeat still queued will be dropped, and a delta can't be applied without it
+    if (_deltaHeartbeats && !_needsSnapshot && !_loop.hasQueuedHeartbeat(*this)) {
+        _loop.sendHeartbeat(*this, webSocket ? heartbeat.webSocketDelta : heartbeat.delta);
+    } else {
+        _loop.sendHeartbeat(*this, webSocket ? heartbeat.webSocketSnapshot : heartbeat.snapshot);
+        _needsSnapshot = false;
+    }
+}
+
+void ClientConnection::requestSnapshot() {
+    _needsSnapshot = true;
+    // Deltas are relative to the last heartbeat, so its snapshot is the right one to resync from
+    auto heartbeats = _loop.lastHeartbeats();
+    if (heartbeats) heartbeat(*heartbeats);
 }
 
 
@@ -322,18 +509,29 @@ void ClientConnection::selectPlaylist(std::string const & name) {
 
 
 ClientConnection::Conversation::Conversation(ClientConnection & owner, int id)
- : _owner(owner), _lastActive(std::chrono::steady_clock::now()), _state(0), _id(id) {}
+ : _owner(owner), _timeout([this](){ _owner.handleTimeout(*this); }), _state(0), _id(id) {}
 
-ClientConnection::Conversation::Status ClientConnection::Conversation::handlePacket(nlohmann::json const & packet) {
+void ClientConnection::Conversation::reset(int id) {
+    _state = 0;
+    _id = id;
+    _reset();
+}
+
+ClientConnection::Conversation::Status ClientConnection::Conversation::handlePacket(InboundPacket const & packet) {
     Status status = _handlePacket(packet);
     // Refresh the timeout if the packet was correctly processed
     if (status == Status::CONTINUING) {
-        _lastActive = std::chrono::steady_clock::now();
+        _owner._loop.timers().schedule(_timeout, timeout);
     }
     return status;
 }
 
 void ClientConnection::Conversation::sendPacket(nlohmann::json & json) {
-    json["id"] = _id;
-    _owner.sendPacket(json);
+    sendPacket(_owner, _id, json);
+}
+
+void ClientConnection::Conversation::sendPacket(ClientConnection & owner, int id,
+                                                nlohmann::json & json) {
+    json["id"] = id;
+    owner.sendPacket(json);
 }
@@ -1,22 +1,50 @@
 #ifndef CLIENT_CONNECTION_HPP
 #define CLIENT_CONNECTION_HPP
 
+#include <array>
 #include <chrono>
 #include <functional>
 #include <map>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <string>
-#include <thread>
+#include <string_view>
+#include <vector>
 
+#include "inbound_packet.hpp"
 #include "server.hpp"
+#include "timer_wheel.hpp"
+#include "websocket.hpp"
 
 
-struct pollfd; // Forward-declared because it's sufficient, over `#include <poll.h>`
+class EventLoop;
 
 
 // Manages a connection with a client, including the selected playlist, etc.
+// This is plain per-connection state; the owning `EventLoop` feeds it socket events
 class ClientConnection {
 public:
+    using Buffer = std::shared_ptr<std::string const>; // Serialized data, shared between connections
+    struct Heartbeat {
+        Buffer snapshot; // The full status
+        Buffer delta; // What changed since the previous heartbeat, for clients that asked for it
+        // The same, as WebSocket messages; null unless the server accepts WebSocket clients
+        Buffer webSocketSnapshot;
+        Buffer webSocketDelta;
+    };
+    using Heartbeats = std::map<unsigned, Heartbeat>; // A serialized heartbeat for each API version
+
+    // How packets are carried; WebSocket messages each hold exactly one packet, without its framing
+    enum class Transport {
+        STREAM,              // Packets are sent as is, delimited according to their format
+        WEBSOCKET_HANDSHAKE, // Waiting for the client's HTTP upgrade request
+        WEBSOCKET            // Upgraded
+    };
+
+    // Player commands complete asynchronously; this is then called from the connection's loop,
+    // unless the connection has been destroyed in the meantime
+    using Completion = std::function<void(ClientConnection & owner, bool success)>;
+
     // Manages a "conversation" of messages
     /* abstract */ class Conversation {
     public:
@@ -33,7 +61,8 @@ public:
     protected:
         ClientConnection & _owner;
     private:
-        std::chrono::steady_clock::time_point _lastActive;
+        friend class ClientConnection; // Which schedules `_timeout`
+        TimerWheel::Timer _timeout; // Only scheduled while the conversation is ongoing
         unsigned _state; // State internal to the type
         int _id;
 
@@ -41,42 +70,47 @@ public:
         Conversation(ClientConnection & owner, int id);
         virtual ~Conversation() = default;
 
-        // This behavior is identical for *all* classes
-        bool hasTimedOut() const {
-            return std::chrono::steady_clock::now() - _lastActive > timeout;
-        };
+        int id() const { return _id; }
+        void reset(int id); // Makes this a brand new conversation, so that it can be reused
+
         virtual void sendTimeout() = 0; // Called when the conversation times out
-        virtual void heartbeat(nlohmann::json const & status) = 0;
+        // Implementations must also provide the following, which must not depend on the connection:
+        // static std::string heartbeat(nlohmann::json const & status);
+        // static std::string heartbeatDelta(nlohmann::json const & delta);
         // Returns true if the packet processed was the last one, then the object is destroyed
-        Status handlePacket(nlohmann::json const & packet);
+        Status handlePacket(InboundPacket const & packet);
 
     protected: // This should be usable by implementors
         using State = unsigned;
         using PacketType = unsigned;
-        using TransitionFunc = std::function<std::pair<Status, State>(nlohmann::json const &)>;
-        template<std::size_t size>
-        using TransitionMapping = std::array<std::map<PacketType, TransitionFunc>, size>;
+        using Transition = std::pair<Status, State>; // What to return, and the state to go to
+        template<typename C>
+        using TransitionFunc = Transition (C::*)(InboundPacket const &);
+        // Indexed by state, then by packet type; null entries are rejected
+        // Implementations should build theirs once, not per packet
+        template<typename C, std::size_t nbStates, std::size_t nbPacketTypes>
+        using TransitionTable = std::array<std::array<TransitionFunc<C>, nbPacketTypes>, nbStates>;
 
         // Utility function for children classes to call
-        template<std::size_t size>
-        Status processStateMachine(TransitionMapping<size> const & transitions, PacketType key,
-                                   nlohmann::json const & packet) {
-            TransitionFunc transitionFunc;
-            try {
-                transitionFunc = transitions[_state].at(key);
-            } catch (std::out_of_range const &) {
+        template<typename C, std::size_t nbStates, std::size_t nbPacketTypes>
+        Status processStateMachine(TransitionTable<C, nbStates, nbPacketTypes> const & transitions,
+                                   PacketType key, InboundPacket const & packet) {
+            if (_state >= nbStates || key >= nbPacketTypes || !transitions[_state][key]) {
                 throw StateMachineRejection(_state, key);
             }
             Status ret;
-            std::tie(ret, _state) = transitionFunc(packet);
+            std::tie(ret, _state) = (static_cast<C &>(*this).*transitions[_state][key])(packet);
             return ret;
         }
 
         void sendPacket(nlohmann::json & json);
+        // For replying once the conversation may be gone, e.g. from a `Completion`
+        static void sendPacket(ClientConnection & owner, int id, nlohmann::json & json);
 
     private:
         // Each implementation's own packet handling
-        virtual Status _handlePacket(nlohmann::json const & packet) = 0;
+        virtual Status _handlePacket(InboundPacket const & packet) = 0;
+        virtual void _reset() = 0; // Must clear all state specific to the implementation
     };
 
 
@@ -86,55 +120,91 @@ public:
 private:
     int _socket;
     Server & _server;
+    EventLoop & _loop; // The loop owning this connection, from which all methods are called
+    bool _trusted; // Whether the client is known to be allowed everything, e.g. from its credentials
+    Transport _transport;
     Server::ConnectionID _id;
 
-    std::string _pending; // Partial messages are stored here
+    // Received data is parsed in place from here; `[_recvStart, _recvEnd)` hasn't been handled yet,
+    // and its first `_recvScanned` bytes are already known not to contain a terminator
+    // The last `InboundPacket::padding` bytes are never written to, only read by the parser
+    std::vector<char> _recvBuffer;
+    std::size_t _recvStart;
+    std::size_t _recvEnd;
+    std::size_t _recvScanned;
+    InboundPacket::Format _format; // How packets are currently encoded and delimited
     unsigned _version; // The version of the API used to dialog over this connection
-    std::map<int, std::unique_ptr<Conversation>> _conversations;
-    std::chrono::steady_clock::time_point _lastActive;
+    bool _deltaHeartbeats; // Whether the client negotiated heartbeats only containing changes
+    bool _needsSnapshot; // Set when the next heartbeat must contain the full status
+    // There are only ever a few conversations at a time, so these are simply scanned
+    std::vector<std::unique_ptr<Conversation>> _conversations;
+    std::vector<std::unique_ptr<Conversation>> _spareConversations; // Finished, kept for reuse
+    TimerWheel::Timer _timeout; // Rescheduled each time the client sends something valid
 
     std::string _playlistName;
     bool _subscribed;
 
-    std::atomic_bool _destructing; // Set to true when the object is being destructed
-    std::atomic_bool _running; // Set to false when the thread stops
-    std::atomic_bool _stopping; // Set to true when the thread should stop (but it may still be running)
-    // Must be last, so it gets initialized last
-    std::thread _thread; // The thread managing the connection
+    bool _stopping; // Set to true once the loop has been asked to destroy the connection
 
 public:
-    ClientConnection(int socket, Server & server, Server::ConnectionID id);
+    ClientConnection(int socket, Server & server, EventLoop & loop, bool trusted,
+                     Transport transport, Server::ConnectionID id);
     ~ClientConnection();
 
     Server::ConnectionID id() const { return _id; }
-    void stop();
-    bool running() const { return _running; }
+    int socket() const { return _socket; }
+    void stop(); // Asks the owning loop to destroy the connection
+    bool stopping() const { return _stopping; }
+
+    // Called by the owning loop, regardless of how it performs I/O
+    // Loops can either receive directly into `receiveBuffer`, then call `handleReceived` with how
+    // much was written, or pass data received elsewhere to `handleData`, which copies it
+    std::pair<char *, std::size_t> receiveBuffer(); // Where to write received data, and how much
+    void handleReceived(std::size_t size);
+    void handleData(std::string_view data);
+    void handleHangup(); // Called when the peer closed the connection
 private:
-    void run();
-    void requestDestruction();
-
-    void handleConnection(struct pollfd const &);
-    void handlePacket(nlohmann::json const & packet);
+    // Finds the first packet in the receive buffer, and returns how many bytes it spans with its
+    // framing, or 0 if it's incomplete; `frame` is set either way, so its size can be checked
+    std::size_t findFrame(std::string_view & frame);
+    // The same, for WebSocket clients; the handshake and control frames are handled along the way
+    std::size_t findWebSocketFrame(std::string_view & frame);
+    void handleControlFrame(WebSocket::Opcode opcode, std::string_view payload);
+    void handlePacket(InboundPacket const & packet);
     void handleNegotiation(nlohmann::json const & packet);
-    bool hasTimedOut() const { return std::chrono::steady_clock::now() - _lastActive > timeout; }
+    // Gets a conversation from the spare ones if possible, instead of allocating a new one
+    Conversation & startConversation(int id);
+    void endConversation(decltype(_conversations)::iterator conversation);
+    void handleTimeout(Conversation & conversation); // Terminates it
 
     void sendPacket(nlohmann::json const & packet);
+    // Wraps data serialized for a stream (in the given format) into a WebSocket message
+    static std::string toWebSocket(std::string const & data, InboundPacket::Format format);
+    Player::Completion onLoop(Completion done) const; // Delivers a player completion to `done`
 
 public:
-    void heartbeat(nlohmann::json const & status);
+    // Serializes a heartbeat once for each API version, so it can be shared by all connections
+    static Heartbeats serializeHeartbeats(nlohmann::json const & status,
+                                          nlohmann::json const & delta, bool webSocket);
+    void heartbeat(Heartbeats const & heartbeats);
 
     // Methods called by the `Conversation`s
+    void requestSnapshot(); // Sends the full status, e.g. if the client missed a delta
     bool subscribed() const { return _subscribed; }
+    bool trusted() const { return _trusted; }
     bool playlistExists(std::string const & name) const { return _server.playlistExists(name); }
 
     void addMusic(Music const & music) { _server.addMusic(_playlistName, music); }
-    void appendMusic(Music const & music) { _server.appendMusic(music); }
+    void addMusics(std::vector<Music> const & musics) { _server.addMusics(_playlistName, musics); }
+    void appendMusic(Music const & music, Completion done) {
+        _server.appendMusic(music, onLoop(std::move(done)));
+    }
     void newPlaylist(std::string const & name, std::string const & pass) {
         _server.newPlaylist(name, pass);
     }
-    void pause() { _server.pause(); }
-    void play() { _server.play(); }
-    void seek(double seconds) { _server.seek(seconds); }
+    void pause(Completion done) { _server.pause(onLoop(std::move(done))); }
+    void play(Completion done) { _server.play(onLoop(std::move(done))); }
+    void seek(double seconds, Completion done) { _server.seek(seconds, onLoop(std::move(done))); }
     void selectPlaylist(std::string const & name);
     void subscribe();
     void unsubscribe();
@@ -143,6 +213,7 @@ public:
 
 // List of classes (extending `Conversation`) handling different API versions
 #include "api/v1.hpp"
+#include "api/v2.hpp"
 
 
 #endif
@@ -72,6 +72,17 @@ ConfigManager::ConfigManager(T const & ... paths) {
     // Insert default values
     // Can't do this from std::map init because it insists on using a copy constructor
     _properties.emplace("port",     std::make_unique<IntProperty<10>>(1939));
+    _properties.emplace("threads",  std::make_unique<IntProperty<10>>(1)); // Event loop count
+    _properties.emplace("listeners", std::make_unique<IntProperty<10>>(0)); // 0 for one per loop
+    _properties.emplace("backlog",  std::make_unique<IntProperty<10>>(1024)); // Per listener
+    _properties.emplace("unix_socket", std::make_unique<StringProperty>("")); // Path, if any
+    _properties.emplace("unix_trusted_uid", std::make_unique<IntProperty<10>>(-1)); // -1 for none
+    _properties.emplace("ws_port",  std::make_unique<IntProperty<10>>(0)); // 0 for no WebSocket
+    _properties.emplace("io_backend", std::make_unique<StringProperty>("epoll")); // Or "io_uring"
+    _properties.emplace("keepalive", std::make_unique<IntProperty<10>>(5000)); // In milliseconds
+    _properties.emplace("max_frame", std::make_unique<IntProperty<10>>(65536)); // In bytes
+    _properties.emplace("max_output", std::make_unique<IntProperty<10>>(1048576)); // In bytes
+    _properties.emplace("data_dir", std::make_unique<StringProperty>("")); // "" to not persist the library
 
     // Try opening all INI files, grabbing the first matching one (the most specific)
     std::ifstream configFile;
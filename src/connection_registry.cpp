@@ -0,0 +1,78 @@
+
+#include <stdexcept>
+#include <string>
+
+#include "connection_registry.hpp"
+
+
+static std::uint64_t constexpr mask(unsigned bits) {
+    return (std::uint64_t(1) << bits) - 1;
+}
+
+
+ConnectionRegistry::ConnectionRegistry(unsigned tag)
+ : _tag(tag), _chunks(), _live(), _free(none) {
+    if (tag > mask(tagBits)) {
+        throw std::runtime_error("Connection registry tag " + std::to_string(tag) + " is too large");
+    }
+}
+
+
+ClientConnection * ConnectionRegistry::find(Server::ConnectionID id) {
+    auto index = this->index(id);
+    return index ? &*slot(*index).connection : nullptr;
+}
+
+void ConnectionRegistry::erase(Server::ConnectionID id) {
+    auto index = this->index(id);
+    if (!index) return;
+    Slot & slot = this->slot(*index);
+
+    slot.connection.reset();
+    // Fill the hole in `_live` with its last element
+    this->slot(_live.back()).link = slot.link;
+    _live[slot.link] = _live.back();
+    _live.pop_back();
+
+    slot.generation = (slot.generation + 1) & mask(generationBits);
+    slot.link = _free;
+    _free = *index;
+}
+
+void ConnectionRegistry::clear() {
+    while (!_live.empty()) {
+        erase(slot(_live.back()).connection->id());
+    }
+}
+
+
+Server::ConnectionID ConnectionRegistry::id(std::uint32_t index, std::uint32_t generation) const {
+    return std::uint64_t(generation) << (tagBits + indexBits)
+         | std::uint64_t(index) << tagBits
+         | _tag;
+}
+
+std::optional<std::uint32_t> ConnectionRegistry::index(Server::ConnectionID id) const {
+    std::uint64_t const index = id >> tagBits & mask(indexBits);
+    if ((id & mask(tagBits)) != _tag || index >= _chunks.size() * chunkSize) return std::nullopt;
+
+    Slot const & slot = (*_chunks[index / chunkSize])[index % chunkSize];
+    if (!slot.connection || slot.generation != id >> (tagBits + indexBits)) return std::nullopt;
+    return index;
+}
+
+void ConnectionRegistry::grow() {
+    std::uint32_t const first = _chunks.size() * chunkSize;
+    if (first + chunkSize > mask(indexBits) + 1) {
+        throw std::runtime_error("Too many connections");
+    }
+
+    _chunks.push_back(std::make_unique<Chunk>());
+    // Chain the new slots in front of the free list
+    for (std::uint32_t i = 0; i < chunkSize; ++i) {
+        Slot & slot = (*_chunks.back())[i];
+        slot.generation = 0;
+        slot.link = i + 1 < chunkSize ? first + i + 1 : _free;
+    }
+    _free = first;
+}
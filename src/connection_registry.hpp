@@ -0,0 +1,102 @@
+#ifndef CONNECTION_REGISTRY_HPP
+#define CONNECTION_REGISTRY_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "client_connection.hpp"
+#include "server.hpp"
+
+
+// The connections of an event loop, kept in a slab: finding, adding and removing one is O(1)
+// IDs are generation-tagged slot indices, so slots can be reused without a stale ID (e.g. held by
+// a pending completion) ever designating the connection which took its slot
+// Connections never move once added, and the ones alive are iterated over from a dense array
+class ConnectionRegistry {
+public:
+    // How IDs are laid out, from the low bits up; only the low 56 bits are used, so that backends
+    // may pack an ID with some bits of their own
+    static unsigned constexpr tagBits = 8; // Tells registries apart, e.g. in logs
+    static unsigned constexpr indexBits = 24;
+    static unsigned constexpr generationBits = 24; // Wraps around after that many reuses of a slot
+
+private:
+    struct Slot {
+        std::uint32_t generation; // Bumped each time the slot is freed, invalidating its old ID
+        std::uint32_t link; // The slot's position in `_live` if used, the next free slot otherwise
+        std::optional<ClientConnection> connection;
+    };
+    static std::size_t constexpr chunkSize = 64;
+    using Chunk = std::array<Slot, chunkSize>;
+    static std::uint32_t constexpr none = ~std::uint32_t(0);
+
+    std::uint64_t _tag;
+    std::vector<std::unique_ptr<Chunk>> _chunks; // Slots are allocated by chunks, so they never move
+    std::vector<std::uint32_t> _live; // The indices of the slots in use, in no particular order
+    std::uint32_t _free; // The first free slot, or `none`
+
+public:
+    class Iterator {
+        ConnectionRegistry * _registry;
+        std::vector<std::uint32_t>::const_iterator _index;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = ClientConnection;
+        using difference_type = std::ptrdiff_t;
+        using pointer = ClientConnection *;
+        using reference = ClientConnection &;
+
+        Iterator(ConnectionRegistry & registry, std::vector<std::uint32_t>::const_iterator index)
+         : _registry(&registry), _index(index) {}
+
+        ClientConnection & operator*() const { return *_registry->slot(*_index).connection; }
+        ClientConnection * operator->() const { return &**this; }
+        Iterator & operator++() { ++_index; return *this; }
+        bool operator==(Iterator const & other) const { return _index == other._index; }
+        bool operator!=(Iterator const & other) const { return _index != other._index; }
+    };
+
+    ConnectionRegistry(unsigned tag);
+    ConnectionRegistry(ConnectionRegistry const &) = delete;
+    ConnectionRegistry & operator=(ConnectionRegistry const &) = delete;
+    ~ConnectionRegistry() { clear(); }
+
+    // Constructs a connection from `args`, followed by its new ID
+    template<typename... Args>
+    ClientConnection & emplace(Args &&... args) {
+        if (_free == none) grow();
+        std::uint32_t const index = _free;
+        Slot & slot = this->slot(index);
+
+        // Only take the slot once the connection is constructed, in case that throws
+        slot.connection.emplace(std::forward<Args>(args)..., id(index, slot.generation));
+        _free = slot.link;
+        slot.link = _live.size();
+        _live.push_back(index);
+        return *slot.connection;
+    }
+    ClientConnection * find(Server::ConnectionID id); // nullptr if it's not (or no longer) here
+    void erase(Server::ConnectionID id); // Destroys the connection, if it's still here
+    void clear();
+
+    std::size_t size() const { return _live.size(); }
+    bool empty() const { return _live.empty(); }
+    Iterator begin() { return Iterator(*this, _live.cbegin()); }
+    Iterator end() { return Iterator(*this, _live.cend()); }
+
+private:
+    Slot & slot(std::uint32_t index) { return (*_chunks[index / chunkSize])[index % chunkSize]; }
+    Server::ConnectionID id(std::uint32_t index, std::uint32_t generation) const;
+    std::optional<std::uint32_t> index(Server::ConnectionID id) const; // If `id` is a slot in use
+    void grow(); // Adds a chunk of free slots
+};
+
+
+#endif
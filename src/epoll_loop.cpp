@@ -0,0 +1,219 @@
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <array>
+#include <stdexcept>
+
+#include "epoll_loop.hpp"
+
+
+EpollLoop::EpollLoop(Server & server, unsigned index)
+ : EventLoop(server, index),
+   _epoll(epoll_create1(EPOLL_CLOEXEC)), _wakeup(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+   _listeners(), _outputs() {
+    if (_epoll == -1) {
+        throw std::runtime_error("Failed to create epoll instance: " + std::string(strerror(errno)));
+    }
+    if (_wakeup == -1) {
+        close(_epoll);
+        throw std::runtime_error("Failed to create eventfd: " + std::string(strerror(errno)));
+    }
+
+    // The wakeup fd is the only one registered with a null pointer
+    struct epoll_event event = { .events = EPOLLIN, .data = { .ptr = nullptr } };
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &event) == -1) {
+        close(_wakeup);
+        close(_epoll);
+        throw std::runtime_error("Failed to register eventfd: " + std::string(strerror(errno)));
+    }
+
+    start();
+}
+
+EpollLoop::~EpollLoop() {
+    shutdown();
+
+    close(_wakeup);
+    close(_epoll);
+}
+
+
+void EpollLoop::run() {
+    std::array<struct epoll_event, 64> events;
+
+    while (_running) {
+        // Only wake up for timeouts when one is due; rounding up, so that it's due by then
+        int timeoutMs = -1;
+        if (auto timeout = nextTimeout(); timeout) {
+            timeoutMs = std::chrono::ceil<std::chrono::milliseconds>(*timeout).count();
+        }
+        int nbEvents = epoll_wait(_epoll, events.data(), events.size(), timeoutMs);
+        if (nbEvents == -1) {
+            if (errno != EINTR) {
+                spdlog::get("logger")->error("EventLoop[{}] epoll_wait() error: {}", _index,
+                                             strerror(errno));
+            }
+            nbEvents = 0;
+        }
+
+        for (int i = 0; i < nbEvents; ++i) {
+            if (events[i].data.ptr == nullptr) {
+                // Tasks were posted; reset the counter before running them, so none are missed
+                uint64_t count;
+                if (read(_wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    spdlog::get("logger")->error("EventLoop[{}] eventfd read() error: {}",
+                                                 _index, strerror(errno));
+                }
+                runTasks();
+            } else if (events[i].data.ptr == this) { // The listener is registered with `this`
+                acceptConnections();
+            } else {
+                ClientConnection & connection = *static_cast<ClientConnection *>(events[i].data.ptr);
+                dispatch(connection, [&](){ handleEvents(connection, events[i].events); });
+            }
+        }
+
+        afterEvents();
+    }
+}
+
+void EpollLoop::wake() {
+    uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        spdlog::get("logger")->error("EventLoop[{}] eventfd write() error: {}", _index,
+                                     strerror(errno));
+    }
+}
+
+void EpollLoop::watchListener(int socket) {
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data = { .ptr = this } };
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, socket, &event) == -1) {
+        spdlog::get("logger")->error("EventLoop[{}] failed to register listener: {}", _index,
+                                     strerror(errno));
+        return;
+    }
+    _listeners.push_back(socket);
+    // Connections may have come in before we started watching, and we're edge-triggered
+    acceptConnections();
+}
+
+void EpollLoop::watchConnection(ClientConnection & connection) {
+    // Sends must never block the loop; whatever doesn't fit is sent once EPOLLOUT comes
+    int flags = fcntl(connection.socket(), F_GETFL);
+    if (flags == -1 || fcntl(connection.socket(), F_SETFL, flags | O_NONBLOCK) == -1) {
+        spdlog::get("logger")->error("EventLoop[{}] failed to make connection {} non-blocking: {}",
+                                     _index, connection.id(), strerror(errno));
+        connection.stop();
+        return;
+    }
+
+    // Being edge-triggered, EPOLLOUT is only reported when the socket stops being full
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data = { .ptr = &connection }
+    };
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, connection.socket(), &event) == -1) {
+        spdlog::get("logger")->error("EventLoop[{}] failed to register connection {}: {}",
+                                     _index, connection.id(), strerror(errno));
+        connection.stop();
+        return;
+    }
+    _outputs.try_emplace(connection.id(), _stats.queuedBytes);
+}
+
+void EpollLoop::unwatchConnection(ClientConnection & connection) {
+    // Closing the socket would do this too, but only if no other process holds a copy of it
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, connection.socket(), nullptr);
+    _outputs.erase(connection.id());
+}
+
+OutputQueue * EpollLoop::outputQueue(ClientConnection & connection) {
+    auto output = _outputs.find(connection.id());
+    return output == _outputs.end() ? nullptr : &std::get<1>(*output);
+}
+
+void EpollLoop::flush(ClientConnection & connection, OutputQueue & output) {
+    // Send as much as possible in one go, until the socket is full
+    while (!output.empty()) {
+        std::array<struct iovec, OutputQueue::maxBatch> iovecs;
+        struct msghdr message = {};
+        message.msg_iov = iovecs.data();
+        message.msg_iovlen = output.fill(iovecs.data(), iovecs.size());
+
+        ssize_t size = sendmsg(connection.socket(), &message, MSG_NOSIGNAL);
+        if (size == -1) {
+            output.consume(0);
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                spdlog::get("logger")->error("ClientConnection[{}] send() error: {}", connection.id(),
+                                             strerror(errno));
+                // The connection can't be salvaged, whether the pipe is broken or not
+                output.dropUnsent();
+                connection.stop();
+            }
+            return;
+        }
+        output.consume(size);
+    }
+}
+
+
+void EpollLoop::acceptConnections() {
+    // Listeners are non-blocking and edge-triggered, so accept until they run dry
+    for (int listener : _listeners) {
+        while (true) {
+            int socket = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (socket == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    spdlog::get("logger")->error("accept() error: {}", strerror(errno));
+                }
+                break;
+            }
+            _server.handleNewConnection(listener, socket, *this);
+        }
+    }
+}
+
+void EpollLoop::handleEvents(ClientConnection & connection, uint32_t events) {
+    if (events & EPOLLERR) {
+        spdlog::get("logger")->error("ClientConnection[{}]: socket {} returned error",
+                                     connection.id(), connection.socket());
+    }
+
+    if (events & EPOLLIN) { // Incoming data!
+        // The socket is edge-triggered, so it must be drained entirely
+        while (!connection.stopping()) {
+            // Receive straight into the connection's buffer, so that packets are parsed in place
+            auto [buffer, room] = connection.receiveBuffer();
+            ssize_t size = recv(connection.socket(), buffer, room, MSG_DONTWAIT);
+            if (size == -1) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    spdlog::get("logger")->error("ClientConnection[{}] recv() error: {}",
+                                                 connection.id(), strerror(errno));
+                }
+                break;
+            }
+            if (size == 0) { // This happens when the connection gets closed
+                events |= EPOLLRDHUP;
+                break;
+            }
+            connection.handleReceived(size);
+        }
+    }
+
+    if (events & EPOLLOUT) { // Room was made for what couldn't be sent earlier
+        OutputQueue * output = outputQueue(connection);
+        if (output && !connection.stopping()) flush(connection, *output);
+    }
+
+    if (events & (EPOLLRDHUP | EPOLLHUP)) {
+        connection.handleHangup();
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef EPOLL_LOOP_HPP
+#define EPOLL_LOOP_HPP
+
+#include <unordered_map>
+#include <vector>
+
+#include "event_loop.hpp"
+
+
+// Event loop using an edge-triggered epoll instance, and non-blocking sockets
+class EpollLoop : public EventLoop {
+private:
+    int _epoll; // File descriptor for the epoll instance
+    int _wakeup; // eventfd used to interrupt `epoll_wait` when tasks are posted
+    std::vector<int> _listeners; // Listener sockets we're accepting from
+
+    std::unordered_map<Server::ConnectionID, OutputQueue> _outputs;
+
+public:
+    EpollLoop(Server & server, unsigned index);
+    ~EpollLoop();
+
+private:
+    void run() override;
+    void wake() override;
+    void watchListener(int socket) override;
+    void watchConnection(ClientConnection & connection) override;
+    void unwatchConnection(ClientConnection & connection) override;
+    OutputQueue * outputQueue(ClientConnection & connection) override;
+    void flush(ClientConnection & connection, OutputQueue & output) override;
+
+    void acceptConnections(); // From all listeners, since they share the same epoll data
+    void handleEvents(ClientConnection & connection, uint32_t events);
+};
+
+
+#endif
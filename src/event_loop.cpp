@@ -0,0 +1,171 @@
+
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "epoll_loop.hpp"
+#include "event_loop.hpp"
+#include "uring_loop.hpp"
+
+
+std::unique_ptr<EventLoop> EventLoop::create(std::string const & backend, Server & server,
+                                             unsigned index) {
+    if (backend == "io_uring") {
+#ifdef MUSICBOTD_IO_URING
+        try {
+            return std::make_unique<UringLoop>(server, index);
+        } catch (std::runtime_error const & e) {
+            spdlog::get("logger")->warn("Event loop {} couldn't use io_uring, falling back to epoll: {}",
+                                        index, e.what());
+        }
+#else
+        spdlog::get("logger")->warn("io_uring support was not compiled in, falling back to epoll");
+#endif
+    } else if (backend != "epoll") {
+        throw std::runtime_error("Unknown I/O backend \"" + backend + "\"");
+    }
+
+    return std::make_unique<EpollLoop>(server, index);
+}
+
+
+EventLoop::EventLoop(Server & server, unsigned index)
+ : _server(server), _index(index), _running(true), _tasks(), _timers(), _connections(index), _stats(),
+   _nbConnections(0), _closingRequests(), _lastHeartbeats() {}
+
+
+void EventLoop::stop() {
+    _running = false;
+    wake();
+}
+
+void EventLoop::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(_tasksMutex);
+        _tasks.push_back(std::move(task));
+    }
+    wake();
+}
+
+
+void EventLoop::listen(int socket) {
+    post([this, socket](){ watchListener(socket); });
+}
+
+void EventLoop::addConnection(int socket, std::string peer, bool trusted,
+                              ClientConnection::Transport transport) {
+    auto add = [this, socket, peer = std::move(peer), trusted, transport](){
+        // This runs in the loop, which must survive a flood of connections, so the error stops here
+        ClientConnection * added;
+        try {
+            added = &_connections.emplace(socket, _server, *this, trusted, transport);
+        } catch (std::exception const & e) {
+            spdlog::get("logger")->warn("Rejecting connection from {}: {}", peer, e.what());
+            close(socket);
+            return;
+        }
+        ClientConnection & connection = *added;
+        spdlog::get("logger")->info("Accepted connection {} from {}", connection.id(), peer);
+        ++_nbConnections;
+        watchConnection(connection);
+    };
+    // Loops mostly keep the connections they accept, which needn't go through the task queue
+    if (std::this_thread::get_id() == _thread.get_id()) {
+        add();
+    } else {
+        post(std::move(add));
+    }
+}
+
+void EventLoop::heartbeat(std::shared_ptr<ClientConnection::Heartbeats const> heartbeats) {
+    post([this, heartbeats](){
+        _lastHeartbeats = heartbeats;
+        for (ClientConnection & connection : _connections) {
+            dispatch(connection, [&](){ connection.heartbeat(*heartbeats); });
+        }
+    });
+}
+
+
+void EventLoop::addWishToDie(Server::ConnectionID id) {
+    _closingRequests.push_back(id);
+}
+
+bool EventLoop::hasQueuedHeartbeat(ClientConnection & connection) {
+    OutputQueue * output = outputQueue(connection);
+    return output && output->hasHeartbeat();
+}
+
+void EventLoop::queue(ClientConnection & connection, ClientConnection::Buffer data, bool heartbeat) {
+    OutputQueue * output = outputQueue(connection);
+    if (!output || connection.stopping()) return;
+
+    _stats.droppedHeartbeats += output->push(std::move(data), heartbeat);
+    if (output->bytes() > _server.maxOutputSize()) {
+        spdlog::get("logger")->warn("ClientConnection[{}] has {} bytes ({} packets) waiting to be sent, closing",
+                                    connection.id(), output->bytes(), output->size());
+        ++_stats.slowDisconnects;
+        connection.stop();
+        return;
+    }
+    flush(connection, *output);
+}
+
+ClientConnection * EventLoop::connection(Server::ConnectionID id) {
+    return _connections.find(id);
+}
+
+
+void EventLoop::start() {
+    _thread = std::thread([&](){
+        spdlog::get("logger")->trace("Event loop {} up and running!", _index);
+        run();
+        spdlog::get("logger")->trace("Event loop {} finished running", _index);
+    });
+}
+
+void EventLoop::shutdown() {
+    spdlog::get("logger")->trace("Stopping event loop {}...", _index);
+
+    stop();
+    _thread.join();
+
+    // The thread is gone, so it's safe to touch the connections from here
+    _connections.clear();
+    _nbConnections = 0;
+
+    spdlog::get("logger")->trace("Event loop {} stopped.", _index);
+}
+
+
+void EventLoop::runTasks() {
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(_tasksMutex);
+        std::swap(tasks, _tasks);
+    }
+
+    for (auto const & task : tasks) {
+        task();
+    }
+}
+
+void EventLoop::afterEvents() {
+    // Only what is due is looked at, however many connections are idling
+    _timers.advance(std::chrono::steady_clock::now());
+
+    // Only destroy connections now, since the events just processed may have been pointing to them
+    for (Server::ConnectionID id : _closingRequests) {
+        handleClosingConnection(id);
+    }
+    _closingRequests.clear();
+}
+
+void EventLoop::handleClosingConnection(Server::ConnectionID id) {
+    ClientConnection * connection = _connections.find(id);
+    if (!connection) return;
+
+    unwatchConnection(*connection);
+    _connections.erase(id);
+    --_nbConnections;
+}
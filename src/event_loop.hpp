@@ -0,0 +1,139 @@
+#ifndef EVENT_LOOP_HPP
+#define EVENT_LOOP_HPP
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client_connection.hpp"
+#include "connection_registry.hpp"
+#include "output_queue.hpp"
+#include "server.hpp"
+#include "timer_wheel.hpp"
+
+
+// Owns a set of client connections, and dispatches their socket events from a single thread
+// Connections are only ever touched from that thread; other threads must go through `post`
+// This is abstract: implementations provide the actual I/O mechanism (epoll, io_uring...)
+/* abstract */ class EventLoop {
+public:
+    // Readable from any thread
+    struct Stats {
+        std::atomic_size_t queuedBytes; // Waiting to be sent, across all connections
+        std::atomic_size_t droppedHeartbeats; // Stale ones, replaced before they could be sent
+        std::atomic_size_t slowDisconnects; // Connections closed for not reading fast enough
+    };
+
+    // Creates a loop using the requested backend, falling back to epoll if it's unavailable
+    static std::unique_ptr<EventLoop> create(std::string const & backend, Server & server,
+                                             unsigned index);
+
+protected:
+    Server & _server;
+    unsigned _index; // Only used for logging
+
+    std::atomic_bool _running; // Set to false when the loop should stop
+
+private:
+    std::mutex _tasksMutex; // Mutex for modifying what's below
+    std::vector<std::function<void()>> _tasks; // Functions to run from the loop's thread
+
+    // Declared before the connections, since their timers must be destroyed first
+    TimerWheel _timers;
+protected:
+    ConnectionRegistry _connections; // Tagged with the loop's index
+    Stats _stats;
+private:
+    std::atomic_size_t _nbConnections; // Readable from any thread, unlike `_connections`
+    std::vector<Server::ConnectionID> _closingRequests; // The IDs of the connections wishing to die
+    std::shared_ptr<ClientConnection::Heartbeats const> _lastHeartbeats; // The latest broadcast
+
+    std::thread _thread; // The thread running the loop, started by implementations via `start`
+
+public:
+    EventLoop(Server & server, unsigned index);
+    virtual ~EventLoop() = default; // Implementations must have called `shutdown` by then
+
+    void stop(); // Signals the loop to stop, but doesn't wait for it
+    void post(std::function<void()> task); // Runs `task` from the loop's thread, eventually
+
+    bool empty() const { return _nbConnections == 0; }
+    Stats const & stats() const { return _stats; }
+
+    // These may be called from any thread
+    void listen(int socket); // Start accepting connections from the given listener socket too
+    // `peer` describes the client, for logging; `trusted` clients may skip password checks
+    void addConnection(int socket, std::string peer, bool trusted,
+                       ClientConnection::Transport transport);
+    void heartbeat(std::shared_ptr<ClientConnection::Heartbeats const> heartbeats);
+
+    // These must be called from the loop's thread
+    void addWishToDie(Server::ConnectionID id); // Call to request a ClientConnection's destruction
+    ClientConnection * connection(Server::ConnectionID id); // nullptr if it's not (or no longer) here
+    TimerWheel & timers() { return _timers; }
+    std::shared_ptr<ClientConnection::Heartbeats const> const & lastHeartbeats() const {
+        return _lastHeartbeats;
+    }
+    // Sending never blocks: data is queued, and sent when the socket is ready for it
+    void send(ClientConnection & connection, ClientConnection::Buffer data) {
+        queue(connection, std::move(data), false);
+    }
+    void sendHeartbeat(ClientConnection & connection, ClientConnection::Buffer data) {
+        queue(connection, std::move(data), true);
+    }
+    bool hasQueuedHeartbeat(ClientConnection & connection); // If so, it'd be replaced by a new one
+
+protected:
+    void start(); // To be called at the end of implementations' constructors
+    void shutdown(); // To be called at the beginning of implementations' destructors
+
+    void runTasks();
+    void afterEvents(); // To be called after each batch of events, handles timeouts and closing
+    // How long implementations may wait for events, or nothing if they may wait indefinitely
+    std::optional<std::chrono::steady_clock::duration> nextTimeout() const {
+        return _timers.nextExpiry(std::chrono::steady_clock::now());
+    }
+
+public:
+    // Runs `func` on behalf of a connection, stopping the connection if anything goes wrong
+    // Must be called from the loop's thread
+    template<typename F>
+    void dispatch(ClientConnection & connection, F && func) {
+        try {
+            func();
+        } catch (std::exception const & e) {
+            spdlog::get("logger")->error("ClientConnection[{}]: Exception at top level: {}",
+                                         connection.id(), e.what());
+            connection.stop();
+        } catch (...) {
+            spdlog::get("logger")->error("ClientConnection[{}]: Unknown exception at top level",
+                                         connection.id());
+            connection.stop();
+        }
+    }
+
+private:
+    // Each implementation's own I/O handling
+    virtual void run() = 0;
+    virtual void wake() = 0; // Must interrupt `run`'s waiting, and have it call `runTasks`
+    virtual void watchListener(int socket) = 0;
+    virtual void watchConnection(ClientConnection & connection) = 0;
+    virtual void unwatchConnection(ClientConnection & connection) = 0;
+    virtual OutputQueue * outputQueue(ClientConnection & connection) = 0; // nullptr if not watched
+    virtual void flush(ClientConnection & connection, OutputQueue & output) = 0; // Start sending
+
+    // Enforces the limit on queued data, disconnecting clients that don't keep up
+    void queue(ClientConnection & connection, ClientConnection::Buffer data, bool heartbeat);
+    void handleClosingConnection(Server::ConnectionID id); // Destroy a connection object from its ID
+};
+
+
+#endif
@@ -0,0 +1,149 @@
+
+#include <limits>
+
+#include "inbound_packet.hpp"
+
+
+template<typename T>
+static T get(nlohmann::json const & json, char const * key) {
+    try {
+        return json.at(key).get<T>();
+    } catch (nlohmann::json::exception const & e) {
+        throw InboundPacket::Error(std::string("\"") + key + "\": " + e.what());
+    }
+}
+
+// Fully parses the packet; this is the only way to decode anything but JSON
+static nlohmann::json parse(char const * begin, char const * end, InboundPacket::Format format) {
+    try {
+        switch (format) {
+            case InboundPacket::Format::JSON:
+                return nlohmann::json::parse(begin, end);
+            case InboundPacket::Format::MESSAGEPACK:
+                return nlohmann::json::from_msgpack(begin, end);
+        }
+    } catch (nlohmann::json::parse_error const & e) {
+        throw InboundPacket::Error(e.what());
+    }
+    throw InboundPacket::Error("Unknown packet format");
+}
+
+
+#ifdef MUSICBOTD_SIMDJSON
+
+// Reusing the parser is what makes simdjson fast, and each loop thread parses one packet at a time
+static thread_local simdjson::ondemand::parser parser;
+
+// Unwraps a simdjson result, or throws an `Error` naming the offending field
+template<typename T>
+static T check(simdjson::simdjson_result<T> && result, char const * key) {
+    T value;
+    auto error = std::move(result).get(value);
+    if (error) {
+        throw InboundPacket::Error(std::string("\"") + key + "\": " + simdjson::error_message(error));
+    }
+    return value;
+}
+
+InboundPacket::InboundPacket(char const * begin, char const * end, Format format)
+ : _text(begin, end - begin), _document(), _json() {
+    // simdjson only handles JSON, anything else gets a tree, which the getters then use
+    if (format != Format::JSON) {
+        _json = parse(begin, end, format);
+        return;
+    }
+
+    auto error = parser.iterate(simdjson::padded_string_view(begin, _text.size(),
+                                                             _text.size() + padding))
+                       .get(_document);
+    if (error) {
+        throw Error(simdjson::error_message(error));
+    }
+}
+
+std::string InboundPacket::dump() const {
+    return _json ? _json->dump() : std::string(_text);
+}
+
+bool InboundPacket::isObject() const {
+    if (_json) return _json->is_object();
+    simdjson::ondemand::json_type type;
+    return !_document.type().get(type) && type == simdjson::ondemand::json_type::object;
+}
+
+bool InboundPacket::contains(char const * key) const {
+    if (_json) return _json->is_object() && _json->contains(key);
+    return _document.find_field_unordered(key).error() == simdjson::SUCCESS;
+}
+
+int InboundPacket::getInt(char const * key) const {
+    if (_json) return get<int>(*_json, key);
+    int64_t value = check(_document.find_field_unordered(key).get_int64(), key);
+    if (value < std::numeric_limits<int>::min() || value > std::numeric_limits<int>::max()) {
+        throw Error(std::string("\"") + key + "\": number out of range");
+    }
+    return value;
+}
+
+unsigned InboundPacket::getUnsigned(char const * key) const {
+    if (_json) return get<unsigned>(*_json, key);
+    uint64_t value = check(_document.find_field_unordered(key).get_uint64(), key);
+    if (value > std::numeric_limits<unsigned>::max()) {
+        throw Error(std::string("\"") + key + "\": number out of range");
+    }
+    return value;
+}
+
+double InboundPacket::getDouble(char const * key) const {
+    if (_json) return get<double>(*_json, key);
+    return check(_document.find_field_unordered(key).get_double(), key);
+}
+
+bool InboundPacket::getBool(char const * key) const {
+    if (_json) return get<bool>(*_json, key);
+    return check(_document.find_field_unordered(key).get_bool(), key);
+}
+
+std::string InboundPacket::getStr(char const * key) const {
+    if (_json) return get<std::string>(*_json, key);
+    return std::string(check(_document.find_field_unordered(key).get_string(), key));
+}
+
+nlohmann::json const & InboundPacket::json() const {
+    if (!_json) {
+        _json = parse(_text.begin(), _text.end(), Format::JSON);
+    }
+    return *_json;
+}
+
+
+#else
+
+// Without simdjson, everything is parsed up front, and fields are simply looked up
+
+InboundPacket::InboundPacket(char const * begin, char const * end, Format format)
+ : _text(begin, end - begin), _json(parse(begin, end, format)) {}
+
+std::string InboundPacket::dump() const {
+    return _json->dump();
+}
+
+bool InboundPacket::isObject() const {
+    return _json->is_object();
+}
+
+bool InboundPacket::contains(char const * key) const {
+    return _json->is_object() && _json->contains(key);
+}
+
+int InboundPacket::getInt(char const * key) const { return get<int>(*_json, key); }
+unsigned InboundPacket::getUnsigned(char const * key) const { return get<unsigned>(*_json, key); }
+double InboundPacket::getDouble(char const * key) const { return get<double>(*_json, key); }
+bool InboundPacket::getBool(char const * key) const { return get<bool>(*_json, key); }
+std::string InboundPacket::getStr(char const * key) const { return get<std::string>(*_json, key); }
+
+nlohmann::json const & InboundPacket::json() const {
+    return *_json;
+}
+
+#endif
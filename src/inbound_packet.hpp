@@ -0,0 +1,68 @@
+#ifndef INBOUND_PACKET_HPP
+#define INBOUND_PACKET_HPP
+
+#include <cstddef>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifdef MUSICBOTD_SIMDJSON
+#include <simdjson.h>
+#endif
+
+
+// A packet received from a client, whose fields are only decoded when asked for
+// With simdjson, no tree is built for JSON unless `json` is called; otherwise, this wraps
+// nlohmann::json
+class InboundPacket {
+public:
+    // How packets are encoded, which also determines how they are delimited on the wire
+    enum class Format {
+        JSON,       // Text, terminated by a NUL byte
+        MESSAGEPACK // Binary, preceded by its size as a big-endian 32-bit integer
+    };
+
+    // Thrown when the packet is malformed, or a field is missing or of the wrong type
+    class Error : public std::runtime_error {
+    public:
+        Error(std::string const & what) : std::runtime_error(what) {}
+    };
+
+    // How many readable bytes must follow a packet's text, for the parser to work in place
+#ifdef MUSICBOTD_SIMDJSON
+    static std::size_t constexpr padding = simdjson::SIMDJSON_PADDING;
+#else
+    static std::size_t constexpr padding = 0;
+#endif
+
+private:
+    std::string_view _text;
+#ifdef MUSICBOTD_SIMDJSON
+    // Reading fields moves an internal cursor, hence `mutable`
+    // This refers to its thread's parser, so only one packet per thread may be alive at a time
+    mutable simdjson::ondemand::document _document;
+#endif
+    mutable std::optional<nlohmann::json> _json; // The full tree, only built if needed
+
+public:
+    // `[begin, end)` is not copied, so it must outlive this, and be followed by `padding` bytes
+    InboundPacket(char const * begin, char const * end, Format format = Format::JSON);
+
+    std::string dump() const; // The packet as JSON text, for logging
+    bool isObject() const;
+    bool contains(char const * key) const;
+
+    // These throw `Error` if the field is missing, or isn't of the right type
+    int getInt(char const * key) const;
+    unsigned getUnsigned(char const * key) const;
+    double getDouble(char const * key) const;
+    bool getBool(char const * key) const;
+    std::string getStr(char const * key) const;
+
+    nlohmann::json const & json() const; // For the rare cases which need the whole tree
+};
+
+
+#endif
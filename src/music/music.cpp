@@ -1,46 +1,72 @@
-
-#include <set>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
 
 #include "music.hpp"
 
 
 Music::Music(std::string const & url)
- : _url(url) {}
+ : _track(makeTrack(url, Options())) {}
 
+Music::Music(std::string const & url, Options options)
+ : _track(makeTrack(url, std::move(options))) {}
 
-static std::set<std::string> const allowedProperties{
-    "start", "stop"
-};
 
-void Music::setOption(std::string const & key, std::string const & value) {
-    // First, validate the key
-    if (allowedProperties.find(key) == allowedProperties.cend()) {
+static std::size_t optionSlot(std::string const & key) {
+    auto name = std::find_if(Music::optionNames.begin(), Music::optionNames.end(),
+                             [&](char const * name){ return key == name; });
+    if (name == Music::optionNames.end()) {
         throw std::out_of_range("Setting property " + key + " is not allowed.");
     }
+    return name - Music::optionNames.begin();
+}
+
+void Music::setOption(std::string const & key, std::string const & value) {
+    // First, validate the key
+    std::size_t const slot = optionSlot(key);
 
     // Then, set the option
-    _options.insert_or_assign(key, value);
+    Options options = _track->options;
+    options[slot] = value;
+    _track = makeTrack(_track->url, std::move(options));
 }
 
 void Music::unsetOption(std::string const & key) {
-    auto option = _options.find(key);
+    std::size_t const slot = optionSlot(key);
     // An option that doesn't exist is already unset
-    if (option != _options.end()) {
-        _options.erase(option);
+    if (_track->options[slot]) {
+        Options options = _track->options;
+        options[slot].reset();
+        _track = makeTrack(_track->url, std::move(options));
     }
 }
 
 
-std::string Music::options() const {
-    std::string options;
-    for (auto [key, value] : _options) {
-        if (!options.empty()) options += ",";
-        options += key + "=" + value;
-    }
-    return options;
+bool Music::operator==(Music const & music) const {
+    if (_track == music._track) return true;
+    // Most musics differ, which the fingerprints tell without comparing any string
+    return _track->fingerprint == music._track->fingerprint && _track->url == music._track->url
+        && _track->options == music._track->options;
 }
 
 
-bool Music::operator==(Music const & music) const {
-    return _url == music._url && _options == music._options;
+std::shared_ptr<Music::Track const> Music::makeTrack(std::string url, Options options) {
+    std::hash<std::string> const hash;
+    auto track = std::make_shared<Track>(Track{std::move(url), std::move(options), "", 0});
+
+    track->fingerprint = hash(track->url);
+    // Slots are in a fixed order, so equal sets of options always combine the same way
+    for (std::size_t slot = 0; slot < optionNames.size(); ++slot) {
+        std::optional<std::string> const & value = track->options[slot];
+        if (!value) continue;
+
+        if (!track->optionString.empty()) track->optionString += ",";
+        track->optionString.append(optionNames[slot]).append("=").append(*value);
+
+        for (std::size_t part : { hash(optionNames[slot]), hash(*value) }) {
+            track->fingerprint ^= part + 0x9e3779b97f4a7c15 + (track->fingerprint << 6)
+                                + (track->fingerprint >> 2);
+        }
+    }
+    return track;
 }
@@ -1,22 +1,43 @@
 #ifndef MUSIC_HPP
 #define MUSIC_HPP
 
-#include <map>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <optional>
 #include <string>
 
 
+// A handle to an immutable track: copies share it, so they're cheap and safe across threads
+// Setting options gives this handle a new track, leaving the others untouched
 class Music {
+public:
+    // Only these options are allowed, so each gets a fixed slot, in the order of `optionNames`
+    static std::array<char const *, 2> constexpr optionNames = { "start", "stop" };
+    using Options = std::array<std::optional<std::string>, optionNames.size()>;
+
 private:
-    std::string _url;
-    std::map<std::string, std::string> _options;
+    struct Track {
+        std::string url;
+        Options options;
+        std::string optionString; // The options as mpv expects them, built once
+        std::size_t fingerprint; // Hash of the URL and options
+    };
+    std::shared_ptr<Track const> _track;
+
+    static std::shared_ptr<Track const> makeTrack(std::string url, Options options);
 
 public:
     Music(std::string const & url);
+    Music(std::string const & url, Options options); // `options` must only hold allowed values
     void setOption(std::string const & key, std::string const & value);
     void unsetOption(std::string const & key);
 
-    std::string const & url() const { return _url; }
-    std::string options() const;
+    std::string const & url() const { return _track->url; }
+    std::string const & options() const { return _track->optionString; }
+    Options const & optionValues() const { return _track->options; }
+    // Equal musics have equal fingerprints, so this can index them without rehashing anything
+    std::size_t fingerprint() const { return _track->fingerprint; }
 
     bool operator==(Music const & music) const;
 };
@@ -0,0 +1,246 @@
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "music_log.hpp"
+
+
+static std::size_t constexpr headerSize = 2 * sizeof(std::uint32_t); // Size, then checksum
+
+
+// CRC-32 (as in zlib), which catches torn writes well enough, without the dependency
+static std::uint32_t crc32(char const * data, std::size_t size) {
+    static std::array<std::uint32_t, 256> const table = [](){
+        std::array<std::uint32_t, 256> table;
+        for (std::uint32_t i = 0; i < table.size(); ++i) {
+            std::uint32_t value = i;
+            for (unsigned bit = 0; bit < 8; ++bit) value = value & 1 ? 0xEDB88320 ^ value >> 1 : value >> 1;
+            table[i] = value;
+        }
+        return table;
+    }();
+
+    std::uint32_t crc = 0xFFFFFFFF;
+    for (std::size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ crc >> 8;
+    }
+    return ~crc;
+}
+
+
+template<typename T>
+static void put(std::string & buffer, T value) {
+    buffer.append(reinterpret_cast<char const *>(&value), sizeof(value));
+}
+
+static void putString(std::string & buffer, std::string_view string) {
+    put<std::uint32_t>(buffer, string.size());
+    buffer.append(string);
+}
+
+// Leaves room for the header, which is only known once the record is complete
+static std::size_t startRecord(std::string & buffer, MusicLog::Type type) {
+    std::size_t const start = buffer.size();
+    buffer.append(headerSize, '\0');
+    put(buffer, type);
+    return start;
+}
+
+static void endRecord(std::string & buffer, std::size_t start) {
+    std::uint32_t const size = buffer.size() - start - headerSize;
+    std::uint32_t const checksum = crc32(&buffer[start + headerSize], size);
+    std::memcpy(&buffer[start], &size, sizeof(size));
+    std::memcpy(&buffer[start + sizeof(size)], &checksum, sizeof(checksum));
+}
+
+
+void MusicLog::appendSnapshot(std::string & buffer, std::uint64_t generation) {
+    std::size_t const start = startRecord(buffer, Type::SNAPSHOT);
+    put(buffer, generation);
+    endRecord(buffer, start);
+}
+
+void MusicLog::appendMusic(std::string & buffer, Music const & music) {
+    std::size_t const start = startRecord(buffer, Type::MUSIC);
+    putString(buffer, music.url());
+    // Which slots are set, then their values in order
+    std::uint8_t set = 0;
+    for (std::size_t slot = 0; slot < Music::optionNames.size(); ++slot) {
+        if (music.optionValues()[slot]) set |= 1 << slot;
+    }
+    put(buffer, set);
+    for (auto const & value : music.optionValues()) {
+        if (value) putString(buffer, *value);
+    }
+    endRecord(buffer, start);
+}
+
+void MusicLog::appendPlaylist(std::string & buffer, std::string const & name,
+                              std::string const & password) {
+    std::size_t const start = startRecord(buffer, Type::PLAYLIST);
+    putString(buffer, name);
+    putString(buffer, password);
+    endRecord(buffer, start);
+}
+
+void MusicLog::appendAdd(std::string & buffer, std::string const & name, ID const * ids,
+                         std::size_t count) {
+    std::size_t const start = startRecord(buffer, Type::ADD);
+    putString(buffer, name);
+    put<std::uint32_t>(buffer, count);
+    buffer.append(reinterpret_cast<char const *>(ids), count * sizeof(ID));
+    endRecord(buffer, start);
+}
+
+
+namespace {
+
+// Reads a record's fields, remembering whether any of them went past its end
+class Parser {
+    char const * _position;
+    char const * const _end;
+    bool _failed;
+
+public:
+    Parser(char const * begin, char const * end) : _position(begin), _end(end), _failed(false) {}
+
+    bool failed() const { return _failed; }
+    std::size_t remaining() const { return _end - _position; }
+
+    template<typename T>
+    T get() {
+        T value{};
+        if (static_cast<std::size_t>(_end - _position) < sizeof(T)) {
+            _failed = true;
+        } else {
+            std::memcpy(&value, _position, sizeof(T));
+            _position += sizeof(T);
+        }
+        return value;
+    }
+    void getBytes(void * destination, std::size_t size) {
+        if (static_cast<std::size_t>(_end - _position) < size) {
+            _failed = true;
+        } else {
+            std::memcpy(destination, _position, size);
+            _position += size;
+        }
+    }
+    void getString(std::string & string) {
+        std::uint32_t const size = get<std::uint32_t>();
+        if (_failed || static_cast<std::size_t>(_end - _position) < size) {
+            _failed = true;
+        } else {
+            string.assign(_position, size);
+            _position += size;
+        }
+    }
+};
+
+}
+
+static bool parseRecord(Parser & parser, MusicLog::Record & record) {
+    record.type = parser.get<MusicLog::Type>();
+    switch (record.type) {
+        case MusicLog::Type::SNAPSHOT:
+            record.generation = parser.get<std::uint64_t>();
+            break;
+
+        case MusicLog::Type::MUSIC: {
+            parser.getString(record.url);
+            std::uint8_t const set = parser.get<std::uint8_t>();
+            for (std::size_t slot = 0; slot < Music::optionNames.size(); ++slot) {
+                if (set & 1 << slot) {
+                    parser.getString(record.options[slot].emplace());
+                } else {
+                    record.options[slot].reset();
+                }
+            }
+            break;
+        }
+
+        case MusicLog::Type::PLAYLIST:
+            parser.getString(record.name);
+            parser.getString(record.password);
+            break;
+
+        case MusicLog::Type::ADD: {
+            parser.getString(record.name);
+            std::size_t const size = parser.get<std::uint32_t>() * sizeof(MusicLog::ID);
+            // The IDs take the rest of the record, so a wrong count can't make this allocate much
+            if (parser.failed() || parser.remaining() != size) return false;
+            record.ids.resize(size / sizeof(MusicLog::ID));
+            parser.getBytes(record.ids.data(), size);
+            break;
+        }
+
+        default:
+            return false;
+    }
+    return !parser.failed();
+}
+
+std::size_t MusicLog::read(std::string_view data, std::function<void(Record const &)> const & apply) {
+    Record record{};
+    std::size_t offset = 0;
+    while (data.size() - offset >= headerSize) {
+        std::uint32_t size, checksum;
+        std::memcpy(&size, &data[offset], sizeof(size));
+        std::memcpy(&checksum, &data[offset + sizeof(size)], sizeof(checksum));
+        if (size > data.size() - offset - headerSize) break; // Torn
+
+        char const * body = &data[offset + headerSize];
+        if (crc32(body, size) != checksum) break;
+        Parser parser(body, body + size);
+        if (!parseRecord(parser, record)) break;
+
+        apply(record);
+        offset += headerSize + size;
+    }
+    return offset;
+}
+
+
+std::optional<std::string> MusicLog::readFile(std::string const & path) {
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file == -1) {
+        if (errno == ENOENT) return std::nullopt;
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    std::string data;
+    while (true) {
+        std::size_t const size = data.size();
+        data.resize(size + 1048576);
+        ssize_t const nbRead = ::read(file, &data[size], data.size() - size);
+        if (nbRead == -1 && errno == EINTR) {
+            data.resize(size);
+            continue;
+        }
+        if (nbRead == -1) {
+            std::string const error = strerror(errno);
+            close(file);
+            throw std::runtime_error("Could not read " + path + ": " + error);
+        }
+        data.resize(size + nbRead);
+        if (nbRead == 0) break;
+    }
+    close(file);
+    return data;
+}
+
+void MusicLog::writeAll(int file, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t const written = write(file, data.data(), data.size());
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("write() error: ") + strerror(errno));
+        }
+        data.remove_prefix(written);
+    }
+}
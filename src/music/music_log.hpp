@@ -0,0 +1,57 @@
+#ifndef MUSIC_LOG_HPP
+#define MUSIC_LOG_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "music.hpp"
+
+
+// On-disk format of the music library, shared by the log of changes and by snapshots: a sequence
+// of records, each preceded by its size and checksum, so that a write torn by a crash is detected
+// Integers are stored in native byte order; files aren't meant to move between machines
+class MusicLog {
+public:
+    using ID = std::uint32_t;
+
+    enum class Type : std::uint8_t {
+        SNAPSHOT, // Starts a snapshot, which replaces all logs before `generation`
+        MUSIC,    // A new music, which gets the next ID
+        PLAYLIST, // A new playlist
+        ADD       // Musics added to a playlist (and so to the global one as well)
+    };
+
+    // Only the fields of its type are meaningful; reused from one record to the next
+    struct Record {
+        Type type;
+        std::uint64_t generation;
+        std::string url;
+        Music::Options options;
+        std::string name; // Of the playlist
+        std::string password;
+        std::vector<ID> ids;
+    };
+
+    static void appendSnapshot(std::string & buffer, std::uint64_t generation);
+    static void appendMusic(std::string & buffer, Music const & music);
+    static void appendPlaylist(std::string & buffer, std::string const & name,
+                               std::string const & password);
+    static void appendAdd(std::string & buffer, std::string const & name, ID const * ids,
+                          std::size_t count);
+
+    // Calls `apply` with each record, until the end of `data` or the first torn or corrupt record;
+    // returns how many bytes were read successfully
+    static std::size_t read(std::string_view data, std::function<void(Record const &)> const & apply);
+
+    // Returns nothing if the file doesn't exist; throws on any other error
+    static std::optional<std::string> readFile(std::string const & path);
+    static void writeAll(int file, std::string_view data); // Throws on error
+};
+
+
+#endif
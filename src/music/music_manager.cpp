@@ -1,38 +1,60 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#include <random>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <tuple>
 
 #include "music_manager.hpp"
 
 
-MusicManager::MusicManager()
- : _musics(),
+MusicManager::MusicManager(std::string const & directory)
+ : _musics(), _index(),
    _playlists({decltype(_playlists)::value_type(std::piecewise_construct, std::tuple(""), std::tuple(""))}),
    _global_list(_playlists.begin()), _next(_playlists.begin()),
+   _directory(directory), _pending(), _pendingChanged(), _stopping(false),
+   _generation(0), _log(-1), _logSize(0), _snapshotSize(0), _logBroken(false),
    _thread() {
-    // TODO: read music list and playlists
+    if (_directory.empty()) return;
+
+    recover();
+    _thread = std::thread(&MusicManager::persist, this);
+}
+
+MusicManager::~MusicManager() {
+    if (_thread.joinable()) {
+        // Whatever is pending still gets written
+        {
+            std::lock_guard lock(_mutex);
+            _stopping = true;
+        }
+        _pendingChanged.notify_one();
+        _thread.join();
+    }
+    if (_log != -1) close(_log);
 }
 
 Music MusicManager::nextMusic() {
     spdlog::get("logger")->trace("Trying to add new music...");
+    std::lock_guard lock(_mutex);
 
-    {
-        std::lock_guard lock(_mutex);
-
-        // First, find a playlist that's ready to add from
-        bool looped = false;
-        do {
-            ++_next;
-            if (_next == _playlists.end()) {
-                if (looped) { throw NoMoreMusic(); } // Give up if we already looped
-                // This cannot be the end because there is always at least the global playlist
-                _next = _playlists.begin();
-                looped = true;
-            }
-        } while (!std::get<1>(*_next).isSubscribed());
-    }
+    // First, find a playlist that's ready to add from
+    bool looped = false;
+    do {
+        ++_next;
+        if (_next == _playlists.end()) {
+            if (looped) { throw NoMoreMusic(); } // Give up if we already looped
+            // This cannot be the end because there is always at least the global playlist
+            _next = _playlists.begin();
+            looped = true;
+        }
+    } while (!std::get<1>(*_next).isSubscribed());
 
-    return getMusic(std::get<1>(*_next).nextMusic());
+    return _musics.at(std::get<1>(*_next).nextMusic());
 }
 
 
@@ -41,7 +63,7 @@ bool MusicManager::playlistExists(std::string const & name) const {
     return _playlists.find(name) != _playlists.cend();
 }
 
-// Make sure to return a copy and not a ref because the Music might be deleted
+// Make sure to return a handle and not a ref, so that the track outlives its deletion
 Music MusicManager::getMusic(ID const & id) const {
     std::lock_guard lock(_mutex);
     return _musics.at(id);
@@ -49,33 +71,83 @@ Music MusicManager::getMusic(ID const & id) const {
 
 void MusicManager::addMusic(std::string const & playlist, Music const & music) {
     spdlog::get("logger")->trace("Adding \"{}\" to \"{}\"", music.url(), playlist);
-    std::lock_guard lock(_mutex);
+    {
+        std::lock_guard lock(_mutex);
+        Playlist<ID> & target = _playlists.at(playlist); // Before changing anything
 
-    decltype(_musics)::const_iterator iter =
-        std::find_if(_musics.begin(), _musics.end(),
-                     [&music](typename decltype(_musics)::value_type const & pair) {
-                       return std::get<1>(pair) == music;
-        });
+        ID const known = _musics.size();
+        ID const id = findOrInsert(music);
+        // Now add that Music to the playlist
+        addToPlaylist(target, &id, 1);
 
-    if (iter == _musics.end()) {
-        std::minstd_rand rng;
-        bool inserted;
-        do {
-            std::tie(iter, inserted) = _musics.emplace(std::uniform_int_distribution<ID>()(rng),
-                                                       music);
-        } while (!inserted);
+        if (_directory.empty()) return;
+        if (id >= known) MusicLog::appendMusic(_pending, music);
+        MusicLog::appendAdd(_pending, playlist, &id, 1);
     }
+    _pendingChanged.notify_one();
+}
+
+void MusicManager::addMusics(std::string const & playlist, std::vector<Music> const & musics) {
+    spdlog::get("logger")->trace("Adding {} musics to \"{}\"", musics.size(), playlist);
+    std::vector<ID> ids;
+    ids.reserve(musics.size());
+    {
+        std::lock_guard lock(_mutex);
+        Playlist<ID> & target = _playlists.at(playlist); // Before changing anything
+
+        ID newID = _musics.size(); // New musics get IDs in order, from here
+        for (Music const & music : musics) {
+            ids.push_back(findOrInsert(music));
+            if (ids.back() == newID && !_directory.empty()) {
+                MusicLog::appendMusic(_pending, music);
+                ++newID;
+            }
+        }
+        addToPlaylist(target, ids.data(), ids.size());
 
-    // Now add that Music to the playlist
-    ID id = std::get<0>(*iter);
-    _playlists.at(playlist).addMusic(id);
-    if (!playlist.empty()) _playlists.at("").addMusic(id);
+        if (_directory.empty()) return;
+        MusicLog::appendAdd(_pending, playlist, ids.data(), ids.size());
+    }
+    _pendingChanged.notify_one();
+}
+
+MusicManager::ID MusicManager::findOrInsert(Music const & music) {
+    // The fingerprint was computed when the music was built, outside of the lock
+    auto [candidate, end] = _index.equal_range(music.fingerprint());
+    for (; candidate != end; ++candidate) {
+        if (_musics[std::get<1>(*candidate)] == music) return std::get<1>(*candidate);
+    }
+
+    // The first handle to a track becomes the one everyone shares
+    ID const id = _musics.size();
+    _musics.push_back(music);
+    _index.emplace(music.fingerprint(), id);
+    return id;
+}
+
+void MusicManager::addToPlaylist(Playlist<ID> & playlist, ID const * ids, std::size_t count) {
+    Playlist<ID> & global = _playlists.at("");
+    // Most adds are of a single music, which has no room to make for a batch
+    if (count == 1) {
+        playlist.addMusic(*ids);
+        if (&playlist != &global) global.addMusic(*ids);
+        return;
+    }
+    playlist.addMusics(ids, ids + count);
+    if (&playlist != &global) global.addMusics(ids, ids + count);
 }
 
 void MusicManager::newPlaylist(std::string const & name, std::string const & password) {
     spdlog::get("logger")->trace("New playlist \"{}\"", name);
-    std::lock_guard lock(_mutex);
-    _playlists.emplace(std::piecewise_construct, std::tuple(name), std::tuple(password));
+    {
+        std::lock_guard lock(_mutex);
+        bool const inserted = std::get<1>(_playlists.emplace(std::piecewise_construct,
+                                                             std::tuple(name), std::tuple(password)));
+
+        if (!inserted || _directory.empty()) return;
+        MusicLog::appendPlaylist(_pending, name, password);
+    }
+    _pendingChanged.notify_one();
 }
 
 void MusicManager::subscribe(std::string const & name) {
@@ -92,3 +164,240 @@ bool MusicManager::unsubscribe(std::string const & name) {
     playlist.unsubscribe();
     return !playlist.isSubscribed() && wasSubbed;
 }
+
+
+std::string MusicManager::logPath(std::uint64_t generation) const {
+    return _directory + "/library." + std::to_string(generation) + ".log";
+}
+
+std::string MusicManager::snapshotPath() const {
+    return _directory + "/library.snapshot";
+}
+
+void MusicManager::recover() {
+    auto const start = std::chrono::steady_clock::now();
+    // Playlist passwords are stored in there, so it and its files are only readable by the owner
+    if (mkdir(_directory.c_str(), 0700) == -1 && errno != EEXIST) {
+        throw std::runtime_error("Could not create " + _directory + ": " + strerror(errno));
+    }
+
+    auto apply = [this](MusicLog::Record const & record) {
+        switch (record.type) {
+            case MusicLog::Type::SNAPSHOT:
+                _generation = record.generation;
+                break;
+            case MusicLog::Type::MUSIC:
+                // IDs are handed out in the same order as when the musics were first added
+                findOrInsert(Music(record.url, record.options));
+                break;
+            case MusicLog::Type::PLAYLIST:
+                _playlists.emplace(std::piecewise_construct, std::tuple(record.name),
+                                   std::tuple(record.password));
+                break;
+            case MusicLog::Type::ADD: {
+                auto playlist = _playlists.find(record.name);
+                if (playlist == _playlists.end()) {
+                    throw std::runtime_error("Persisted library refers to unknown playlist \""
+                                             + record.name + "\"");
+                }
+                for (ID id : record.ids) {
+                    if (id >= _musics.size()) {
+                        throw std::runtime_error("Persisted library refers to unknown music "
+                                                 + std::to_string(id));
+                    }
+                }
+                addToPlaylist(std::get<1>(*playlist), record.ids.data(), record.ids.size());
+                break;
+            }
+        }
+    };
+
+    // The snapshot is only put in place once complete, so it must be read entirely
+    if (auto snapshot = MusicLog::readFile(snapshotPath()); snapshot) {
+        if (MusicLog::read(*snapshot, apply) != snapshot->size()) {
+            throw std::runtime_error("Snapshot " + snapshotPath() + " is corrupt");
+        }
+        _snapshotSize = snapshot->size();
+    }
+    // If the directory couldn't be synced after compacting, the snapshot's log was dropped and
+    // changes went on in the previous one; records it shares with the snapshot replay as no-ops
+    bool const previousLog = _generation > 0 && access(logPath(_generation).c_str(), F_OK) == -1
+                          && access(logPath(_generation - 1).c_str(), F_OK) == 0;
+    if (previousLog) --_generation;
+    // The log may end with a write torn by a crash, which is cut off so that appending can resume
+    std::string const path = logPath(_generation);
+    if (auto log = MusicLog::readFile(path); log) {
+        _logSize = MusicLog::read(*log, apply);
+        if (_logSize != log->size()) {
+            spdlog::get("logger")->warn("Discarding {} bytes of torn or corrupt records at the end of {}",
+                                        log->size() - _logSize, path);
+            if (truncate(path.c_str(), _logSize) == -1) {
+                throw std::runtime_error("Could not truncate " + path + ": " + strerror(errno));
+            }
+        }
+    }
+    // Otherwise, a crash while compacting may have left the previous log behind
+    if (!previousLog && _generation > 0) unlink(logPath(_generation - 1).c_str());
+
+    _log = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (_log == -1) {
+        throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+    }
+
+    spdlog::get("logger")->info("Recovered {} musics and {} playlists from {} in {} ms",
+                                _musics.size(), _playlists.size() - 1, _directory,
+                                std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    std::chrono::steady_clock::now() - start
+                                ).count());
+}
+
+void MusicManager::persist() {
+    std::unique_lock lock(_mutex);
+    bool failed = false; // Whether the last attempt did, in which case the next one is delayed
+    while (!_stopping || !_pending.empty()) {
+        if (_pending.empty()) {
+            _pendingChanged.wait(lock);
+            continue;
+        }
+        if (failed) {
+            if (_stopping) {
+                spdlog::get("logger")->error("Giving up on persisting {} bytes of library changes",
+                                             _pending.size());
+                break;
+            }
+            // Retried even if stopping meanwhile, but only once
+            _pendingChanged.wait_for(lock, retryDelay, [this](){ return _stopping; });
+        }
+
+        if (_logBroken) {
+            lock.unlock();
+            failed = !writeSnapshot();
+            lock.lock();
+            continue;
+        }
+
+        // Group commit: whatever piled up while the previous batch was being synced goes out
+        // with a single write and sync
+        std::string batch;
+        batch.swap(_pending);
+        lock.unlock();
+
+        try {
+            MusicLog::writeAll(_log, batch);
+            if (fdatasync(_log) == -1) {
+                throw std::runtime_error(std::string("fdatasync() error: ") + strerror(errno));
+            }
+            _logSize += batch.size();
+            failed = false;
+        } catch (std::exception const & e) {
+            spdlog::get("logger")->error("Failed to persist {} bytes of library changes, will retry: {}",
+                                         batch.size(), e.what());
+            failed = true;
+            // Whatever part of the batch made it is cut off, as records appended after it would be
+            // unreadable; if even that fails, the log can't be appended to anymore
+            if (ftruncate(_log, _logSize) == -1) {
+                spdlog::get("logger")->error("Failed to truncate the library log, a snapshot will "
+                                             "replace it: {}", strerror(errno));
+                _logBroken = true;
+            }
+        }
+
+        // Compacting costs about the size of the snapshot, so this keeps its cost proportional to
+        // the amount of changes
+        if (!failed && _logSize > std::max(minCompactionSize, _snapshotSize)) writeSnapshot();
+
+        lock.lock();
+        // Later records may refer to musics added by it, so a failed batch goes back in front
+        if (failed) _pending.insert(0, batch);
+    }
+}
+
+bool MusicManager::writeSnapshot() {
+    std::uint64_t const generation = _generation + 1;
+    std::string data;
+    std::size_t covered; // How much of `_pending` the snapshot already includes
+
+    // Only handles and IDs are copied under the lock; serializing happens outside of it
+    std::vector<Music> musics;
+    std::vector<std::tuple<std::string, std::string, std::vector<ID>>> playlists;
+    {
+        std::lock_guard lock(_mutex);
+        covered = _pending.size();
+        musics = _musics;
+        for (auto const & [name, playlist] : _playlists) {
+            playlists.emplace_back(name, playlist.password(), playlist.musics());
+        }
+    }
+
+    MusicLog::appendSnapshot(data, generation);
+    for (Music const & music : musics) {
+        MusicLog::appendMusic(data, music);
+    }
+    for (auto const & [name, password, ids] : playlists) {
+        if (!name.empty()) MusicLog::appendPlaylist(data, name, password);
+    }
+    for (auto const & [name, password, ids] : playlists) {
+        MusicLog::appendAdd(data, name, ids.data(), ids.size());
+    }
+
+    // Written aside, then renamed over the previous one, so that there always is a complete one
+    std::string const temporaryPath = snapshotPath() + ".tmp";
+    int log = -1;
+    try {
+        int snapshot = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (snapshot == -1) throw std::runtime_error(std::string("open() error: ") + strerror(errno));
+        try {
+            MusicLog::writeAll(snapshot, data);
+            if (fsync(snapshot) == -1) {
+                throw std::runtime_error(std::string("fsync() error: ") + strerror(errno));
+            }
+        } catch (...) {
+            close(snapshot);
+            throw;
+        }
+        close(snapshot);
+
+        log = open(logPath(generation).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                   0600);
+        if (log == -1) throw std::runtime_error(std::string("open() error: ") + strerror(errno));
+        if (rename(temporaryPath.c_str(), snapshotPath().c_str()) == -1) {
+            throw std::runtime_error(std::string("rename() error: ") + strerror(errno));
+        }
+    } catch (std::exception const & e) {
+        spdlog::get("logger")->error("Failed to write library snapshot, keeping the log: {}", e.what());
+        if (log != -1) {
+            close(log);
+            unlink(logPath(generation).c_str());
+        }
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+
+    // The rename must be durable before the previous log can go; until then, that log stays the
+    // current one, and recovery knows to replay it over the new snapshot
+    int const directory = open(_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory == -1 || fsync(directory) == -1) {
+        spdlog::get("logger")->error("Failed to sync {}, keeping the log: {}", _directory,
+                                     strerror(errno));
+        if (directory != -1) close(directory);
+        close(log);
+        unlink(logPath(generation).c_str());
+        return false;
+    }
+    close(directory);
+
+    close(_log);
+    unlink(logPath(_generation).c_str());
+    _log = log;
+    _generation = generation;
+    _logSize = 0;
+    _snapshotSize = data.size();
+    _logBroken = false;
+    {
+        std::lock_guard lock(_mutex);
+        _pending.erase(0, covered);
+    }
+
+    spdlog::get("logger")->info("Compacted library into a snapshot of {} bytes", data.size());
+    return true;
+}
@@ -2,22 +2,38 @@
 #define MUSIC_MANAGER_HPP
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <map>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "music.hpp"
+#include "music_log.hpp"
 #include "playlist.hpp"
 
 
+// Keeps the library of musics and the playlists made from it
+// If given a directory, all changes are persisted there: each is appended to a log, which gets
+// compacted into a snapshot once it has grown large enough; both are replayed on startup
 class MusicManager {
 public:
-    using ID = uint32_t;
+    using ID = MusicLog::ID;
     using NoMoreMusic = Playlist<ID>::NoMoreMusic;
 
+    static std::size_t constexpr minCompactionSize = 1 << 20; // Smaller logs are left alone
+    static std::chrono::seconds constexpr retryDelay{1}; // After failing to persist changes
+
 private:
-    std::map<ID, Music> _musics;
+    // Indexed by ID, which are handed out in order; each track is stored once, and handed out as
+    // a handle sharing it, rather than copied
+    std::vector<Music> _musics;
+    // Finds musics from their fingerprint; different musics may share one, so this is a multimap
+    std::unordered_multimap<std::size_t, ID> _index;
 
     std::map<std::string, Playlist<ID>> _playlists;
     decltype(_playlists)::const_iterator const _global_list;
@@ -25,10 +41,35 @@ private:
 
     mutable std::mutex _mutex;
 
-    std::thread _thread;
+    // Persistence; what's below is protected by `_mutex`, except what only `_thread` touches
+    std::string const _directory; // Empty if nothing is persisted
+    std::string _pending; // Records of the changes not written yet
+    std::condition_variable _pendingChanged;
+    bool _stopping; // Set when `_thread` should write what's pending, then exit
+    // Only touched by `_thread`, once recovery is done
+    std::uint64_t _generation; // Of the current log; the snapshot replaces all logs before it
+    int _log; // -1 if nothing is persisted
+    std::size_t _logSize;
+    std::size_t _snapshotSize;
+    bool _logBroken; // If a failed write couldn't be cut off, in which case only a snapshot helps
+
+    std::thread _thread; // Writes changes out, so that requests never wait for the disk
+
+    // Returns the ID of `music`, adding it if it's new; `_mutex` must be held
+    ID findOrInsert(Music const & music);
+    // Adds to a playlist, and to the global one as well; `_mutex` must be held
+    void addToPlaylist(Playlist<ID> & playlist, ID const * ids, std::size_t count);
+
+    std::string logPath(std::uint64_t generation) const;
+    std::string snapshotPath() const;
+    void recover(); // Replays the snapshot and log from `_directory`, then opens the log
+    void persist(); // `_thread`'s body: group commits `_pending` to the log, and compacts it
+    // Replaces the log with a snapshot, starting a new generation; returns whether it succeeded
+    bool writeSnapshot();
 
 public:
-    MusicManager();
+    MusicManager(std::string const & directory); // Nothing is persisted if it's empty
+    ~MusicManager();
 
     Music nextMusic();
 
@@ -36,6 +77,7 @@ public:
 
     Music getMusic(ID const & music) const;
     void addMusic(std::string const & name, Music const & music);
+    void addMusics(std::string const & name, std::vector<Music> const & musics); // All at once
     void newPlaylist(std::string const & name, std::string const & pass);
     void subscribe(std::string const & name);
     bool unsubscribe(std::string const & name);
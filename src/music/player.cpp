@@ -1,5 +1,10 @@
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
 #include <cstring>
+#include <algorithm>
 #include <array>
 #include <spdlog/spdlog.h>
 #include <stdexcept>
@@ -8,11 +13,18 @@
 
 
 
-Player::Player()
- : _running(true), _mpv(mpv_create()) {
+Player::Player(std::function<void()> onStatusChange)
+ : _mpv(mpv_create()), _wakeup(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+   _onStatusChange(std::move(onStatusChange)), _endOfFile(), _shutDown(false),
+   _commandsMutex(), _commands(), _pendingCommands(), _nextCommandID(1),
+   _stateMutex(), _state(std::make_shared<State const>()) {
     if (_mpv == nullptr) {
         throw std::runtime_error("Failed to create MPV handle (does LC_NUMERIC != \"C\"?)");
     }
+    if (_wakeup == -1) {
+        mpv_destroy(_mpv);
+        throw std::runtime_error("Failed to create eventfd: " + std::string(strerror(errno)));
+    }
 
     spdlog::get("logger")->trace("Configuring and init-ing MPV player...");
 
@@ -21,106 +33,267 @@ Player::Player()
     mpv_set_option_string(_mpv, "load-scripts", "no"); // Don't load config scripts
     mpv_set_option_string(_mpv, "vid", "no"); // Disable video playback, we're only doing audio!
 
+    // Set before anything can generate events, so that none are missed
+    // This is called from one of mpv's threads, so it must only signal, not handle anything
+    mpv_set_wakeup_callback(_mpv, [](void * player){ static_cast<Player *>(player)->wake(); },
+                            this);
+
     int retcode = mpv_initialize(_mpv);
     if (retcode < 0) {
         throw std::runtime_error("Failed to initialize MPV: " + std::string(mpv_error_string(retcode)));
     }
+
+    // Get notified when anything in the status changes, instead of having to poll for it
+    std::array const observed{
+        std::tuple(PAUSE, "pause", MPV_FORMAT_FLAG),
+        std::tuple(DURATION, "duration", MPV_FORMAT_DOUBLE),
+        std::tuple(PLAYLIST, "playlist", MPV_FORMAT_NODE)
+    };
+    for (auto const & [id, name, format] : observed) {
+        retcode = mpv_observe_property(_mpv, id, name, format);
+        if (retcode < 0) {
+            spdlog::get("logger")->error("Error observing MPV property {}: {}", name,
+                                         mpv_error_string(retcode));
+        }
+    }
 }
 
 Player::~Player() {
     spdlog::get("logger")->trace("Destroying MPV handle...");
+    mpv_set_wakeup_callback(_mpv, nullptr, nullptr);
     mpv_destroy(_mpv);
+    close(_wakeup);
 }
 
 
-void Player::run() {
-    spdlog::get("logger")->trace("MPV player up and running!");
+void Player::wake() {
+    uint64_t one = 1;
+    // This can only fail if the counter is saturated, in which case a wakeup is pending anyway
+    [[maybe_unused]] ssize_t written = write(_wakeup, &one, sizeof(one));
+}
 
-    while (_running) {
-        mpv_event const * event = mpv_wait_event(_mpv, Player::timeout);
-        if (event->event_id != MPV_EVENT_NONE) {
-            spdlog::get("logger")->trace("mpv event: {}", mpv_event_name(event->event_id));
-        }
-        switch (event->event_id) {
-            case MPV_EVENT_NONE:
-                // Do nothing
-                break;
+void Player::handleEvents() {
+    // Reset the counter first, so that events arriving from now on will trigger a new wakeup
+    uint64_t count;
+    if (read(_wakeup, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        spdlog::get("logger")->error("Player eventfd read() error: {}", strerror(errno));
+    }
+
+    // mpv keeps reporting its shutdown once it happened, so stop listening then
+    while (!_shutDown) {
+        mpv_event const * event = mpv_wait_event(_mpv, 0);
+        if (event->event_id == MPV_EVENT_NONE) break; // No more events for now
 
+        spdlog::get("logger")->trace("mpv event: {}", mpv_event_name(event->event_id));
+        switch (event->event_id) {
             case MPV_EVENT_SHUTDOWN:
-                _running = false;
+                spdlog::get("logger")->error("MPV player shut down");
+                _shutDown = true;
                 break;
 
             case MPV_EVENT_END_FILE:
-                runCommand("playlist-remove", "0");
+                _endOfFile = std::chrono::steady_clock::now();
+                queueCommand({}, "playlist-remove", "0");
+                // Like `appendMusic`, let the playlist be refilled without waiting for the reply
+                updateState([](State & state){
+                    if (state.playlist->empty()) return;
+                    state.playlist = std::make_shared<std::vector<std::string>>(
+                        std::next(state.playlist->begin()), state.playlist->end());
+                });
+                _onStatusChange();
+                break;
+
+            case MPV_EVENT_COMMAND_REPLY:
+                handleCommandReply(*event);
+                break;
+
+            case MPV_EVENT_PROPERTY_CHANGE:
+                handlePropertyChange(*event);
+                _onStatusChange();
+                break;
+
+            case MPV_EVENT_PLAYBACK_RESTART: // Seeking makes the position jump
+                _onStatusChange();
+                break;
+
+            default:
                 break;
         }
     }
 
-    spdlog::get("logger")->trace("MPV player finished running");
+    // Commands queued until now, including by the events above, go out without waiting for a wakeup
+    submitCommands();
 }
 
-void Player::stop() {
-    _running = false;
+void Player::submitCommands() {
+    std::vector<Command> commands;
+    {
+        std::lock_guard lock(_commandsMutex);
+        std::swap(commands, _commands);
+    }
+
+    if (_shutDown) {
+        // Neither these nor the ones awaiting a reply will ever run, but their callers still wait
+        for (Command & command : commands) {
+            if (command.done) command.done(MPV_ERROR_UNINITIALIZED);
+        }
+        for (auto & [id, command] : _pendingCommands) {
+            if (command.done) command.done(MPV_ERROR_UNINITIALIZED);
+        }
+        _pendingCommands.clear();
+        return;
+    }
+
+    for (Command & command : commands) {
+        std::vector<char const *> args;
+        for (std::string const & arg : command.args) {
+            args.push_back(arg.c_str());
+        }
+        args.push_back(nullptr);
+
+        uint64_t id = _nextCommandID++;
+        int retcode = mpv_command_async(_mpv, id, args.data());
+        if (retcode < 0) {
+            spdlog::get("logger")->error("Error while running MPV command {}: {}", command.args[0],
+                                         mpv_error_string(retcode));
+            if (command.done) command.done(retcode);
+        } else {
+            _pendingCommands.emplace(id, std::move(command));
+        }
+    }
+}
+
+void Player::handleCommandReply(mpv_event const & event) {
+    auto iter = _pendingCommands.find(event.reply_userdata);
+    if (iter == _pendingCommands.end()) return;
+    Command command = std::move(std::get<1>(*iter));
+    _pendingCommands.erase(iter);
+
+    if (event.error < 0) {
+        spdlog::get("logger")->error("Error while running MPV command {}: {}", command.args[0],
+                                     mpv_error_string(event.error));
+    }
+    if (command.done) command.done(event.error);
 }
 
 
-void Player::appendMusic(Music const & music) {
+void Player::appendMusic(Music const & music, Completion done) {
     std::string const & url = music.url();
     spdlog::get("logger")->trace("Queuing {}", url);
-    runCommand("loadfile", url.c_str(), "append-play", music.options().c_str());
+    // The playlist change event will come later, but callers checking the playlist's size
+    // (e.g. to refill it) must see the new entry right away
+    updateState([&](State & state){
+        auto playlist = std::make_shared<std::vector<std::string>>(*state.playlist);
+        playlist->push_back(url);
+        state.playlist = std::move(playlist);
+        _appending.push_back(url);
+    });
+
+    queueCommand([this, url, done = std::move(done)](int error){
+        updateState([&](State & state){
+            // From now on, reported playlists are up to date with this
+            auto appending = std::find(_appending.begin(), _appending.end(), url);
+            if (appending != _appending.end()) _appending.erase(appending);
+            if (error >= 0) return;
+
+            // Take back the entry added above, since mpv won't report a playlist change
+            auto playlist = std::make_shared<std::vector<std::string>>(*state.playlist);
+            auto entry = std::find(playlist->rbegin(), playlist->rend(), url);
+            if (entry != playlist->rend()) playlist->erase(std::next(entry).base());
+            state.playlist = std::move(playlist);
+        });
+        if (done) done(error);
+    }, "loadfile", url, "append-play", music.options());
 }
 
-void Player::next() {
-    runCommand("playlist-next", "force");
+void Player::next(Completion done) {
+    queueCommand(std::move(done), "playlist-next", "force");
 }
 
-void Player::pause() {
+void Player::pause(Completion done) {
     spdlog::get("logger")->trace("Pausing MPV player");
-    setProperty("pause", true);
+    queueCommand(std::move(done), "set", "pause", "yes");
 }
 
-void Player::play() {
+void Player::play(Completion done) {
     spdlog::get("logger")->trace("Unpausing MPV player");
-    setProperty("pause", false);
+    queueCommand(std::move(done), "set", "pause", "no");
 }
 
-void Player::seek(double seconds) {
-    runCommand("seek", std::to_string(seconds).c_str(), "absolute");
+void Player::seek(double seconds, Completion done) {
+    queueCommand(std::move(done), "seek", std::to_string(seconds), "absolute");
 }
 
 
-unsigned Player::playlistSize() const {
-    mpv_node playlist = getProperty<mpv_node>("playlist");
-    unsigned len = playlist.u.list->num;
-    mpv_free_node_contents(&playlist);
-    return len;
-}
-
 nlohmann::json Player::status() const {
-    nlohmann::json packet{
-        {"duration", getProperty<double>("duration")},
-        {"pause",    getProperty<bool>("pause")},
-        {"playlist", nlohmann::json::array()},
-        {"position", getProperty<double>("playback-time")}
+    std::shared_ptr<State const> state = this->state();
+    // Not observed, since it changes constantly and clients extrapolate it between reports
+    double position = 0;
+    if (mpv_get_property(_mpv, "playback-time", MPV_FORMAT_DOUBLE, &position) < 0) {
+        position = 0; // Nothing is playing
+    }
+    return nlohmann::json{
+        {"duration", state->duration},
+        {"pause",    state->pause},
+        {"playlist", *state->playlist},
+        {"position", position}
     };
+}
+
 
-    // TODO: check the type of the union
-    mpv_node playlist = getProperty<mpv_node>("playlist");
-    for (int i = 0; i < playlist.u.list->num; i++) {
-        mpv_node const & node = playlist.u.list->values[i];
-        for (int j = 0; j < node.u.list->num; j++) {
-            char const * key       = node.u.list->keys[j];
-            mpv_node const & value = node.u.list->values[j];
-
-            if (!strcmp("filename", key)) {
-                packet["playlist"][i] = value.u.string;
-            } else if (!strcmp("title", key)) {
-                packet["playlist"][i] = value.u.string;
-                break; // This one has precedence over `filename`
+void Player::handlePropertyChange(mpv_event const & event) {
+    mpv_event_property const & property = *static_cast<mpv_event_property *>(event.data);
+    // A property may be unavailable (e.g. the duration when nothing is playing)
+    bool available = property.format != MPV_FORMAT_NONE;
+
+    switch (event.reply_userdata) {
+        case PAUSE:
+            updateState([&](State & state){
+                state.pause = available && *static_cast<int *>(property.data);
+            });
+            break;
+
+        case DURATION:
+            updateState([&](State & state){
+                state.duration = available ? *static_cast<double *>(property.data) : 0;
+            });
+            break;
+
+        case PLAYLIST: {
+            auto playlist = std::make_shared<std::vector<std::string>>();
+            std::vector<std::string> filenames; // What was loaded, whereas names may be titles
+            mpv_node const * node = static_cast<mpv_node *>(property.data);
+            if (available && node->format == MPV_FORMAT_NODE_ARRAY) {
+                for (int i = 0; i < node->u.list->num; i++) {
+                    mpv_node const & entry = node->u.list->values[i];
+                    std::string & name = playlist->emplace_back();
+                    std::string & filename = filenames.emplace_back();
+                    if (entry.format != MPV_FORMAT_NODE_MAP) continue;
+
+                    char const * title = nullptr;
+                    for (int j = 0; j < entry.u.list->num; j++) {
+                        char const * key       = entry.u.list->keys[j];
+                        mpv_node const & value = entry.u.list->values[j];
+
+                        if (!strcmp("filename", key)) {
+                            filename = value.u.string;
+                        } else if (!strcmp("title", key)) {
+                            title = value.u.string;
+                        }
+                    }
+                    name = title ? title : filename; // The title has precedence for display
+                }
             }
+            updateState([&](State & state){
+                // This may have been reported before appends still awaiting their reply were made,
+                // which must not be dropped; those already made are at the end, in order
+                std::size_t made = std::min(_appending.size(), filenames.size());
+                auto const first = _appending.begin();
+                while (made > 0 && !std::equal(first, first + made, filenames.end() - made)) --made;
+                playlist->insert(playlist->end(), first + made, _appending.end());
+                state.playlist = std::move(playlist);
+            });
+            break;
         }
     }
-    mpv_free_node_contents(&playlist);
-
-    return packet;
 }
@@ -5,92 +5,115 @@
 #include <mpv/client.h>
 
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
-#include <spdlog/spdlog.h>
+#include <optional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "music.hpp"
 
 
-template<typename>
-struct Format{};
-template<>
-struct Format<bool> {
-    static constexpr mpv_format format = MPV_FORMAT_FLAG;
-    using type = int;
-};
-template<>
-struct Format<int64_t> {
-    static constexpr mpv_format format = MPV_FORMAT_INT64;
-    using type = int64_t;
-};
-template<>
-struct Format<double> {
-    static constexpr mpv_format format = MPV_FORMAT_DOUBLE;
-    using type = double;
-};
-template<>
-struct Format<mpv_node> {
-    static constexpr mpv_format format = MPV_FORMAT_NODE;
-    using type = mpv_node;
-};
-
+// Has no thread of its own: whoever owns it must wait on `fd`, and call `handleEvents`
 class Player {
 public:
-    static double constexpr timeout = 0.1;
+    // Called from `handleEvents` when a command completes, with mpv's error code (>= 0 on success)
+    using Completion = std::function<void(int error)>;
+
+    // Mirror of the properties reported in the status, kept up to date from mpv's events
+    // The position isn't mirrored: it changes constantly, so it's only read for the status
+    struct State {
+        bool pause = false;
+        double duration = 0;
+        // Shared between successive states, since it changes much less often than the rest
+        std::shared_ptr<std::vector<std::string> const> playlist =
+            std::make_shared<std::vector<std::string> const>();
+    };
 
 private:
-    std::atomic_bool _running;
+    // The properties reported in the status, identified by the `reply_userdata` of their changes
+    enum Observed : uint64_t {
+        PAUSE = 1, // 0 would be the `reply_userdata` of events unrelated to observation
+        DURATION,
+        PLAYLIST
+    };
 
     mpv_handle * _mpv;
-
-    template<typename T, typename... Ts>
-    int runCommand(T&& name, Ts&&... args) {
-        char const * command[] = {
-            std::forward<T>(name), std::forward<Ts>(args)..., nullptr
-        };
-        int retcode = mpv_command(_mpv, command);
-        if (retcode < 0) {
-            spdlog::get("logger")->error("Error while running MPV command " + std::string(name) + ": " + mpv_error_string(retcode));
-        }
-        return retcode;
+    int _wakeup; // eventfd written to by mpv when events are available
+    std::function<void()> _onStatusChange; // Called from `handleEvents` when `status` changes
+    std::optional<std::chrono::steady_clock::time_point> _endOfFile; // When the last track ended
+    bool _shutDown; // Once mpv has exited, after which it mustn't be given commands anymore
+
+    struct Command {
+        std::vector<std::string> args;
+        Completion done;
+    };
+    std::mutex _commandsMutex; // Mutex for modifying what's below
+    std::vector<Command> _commands; // Queued from any thread, submitted by `handleEvents`
+    // Commands submitted to mpv and awaiting their reply, by `reply_userdata`
+    // Only touched from `handleEvents`, so this doesn't need locking
+    std::map<uint64_t, Command> _pendingCommands;
+    uint64_t _nextCommandID;
+
+    std::mutex _stateMutex; // Only serializes writers; readers go through `std::atomic_load`
+    std::shared_ptr<State const> _state; // Never modified, only replaced
+    // URLs appended to the playlist whose command hasn't been replied to yet, in order; playlist
+    // changes reported meanwhile may or may not include them. Only modified in `updateState`
+    std::deque<std::string> _appending;
+
+    // Replaces the state with a modified copy of it
+    template<typename F>
+    void updateState(F && func) {
+        std::lock_guard lock(_stateMutex);
+        auto state = std::make_shared<State>(*std::atomic_load(&_state));
+        func(*state);
+        std::atomic_store(&_state, std::shared_ptr<State const>(std::move(state)));
     }
-
-    template<typename T>
-    T getProperty(char const * name) const {
-        typename Format<T>::type data;
-        int retcode = mpv_get_property(_mpv, name, Format<T>::format, &data);
-        if (retcode < 0) {
-            spdlog::get("logger")->error("Error getting MPV property " + std::string(name) + ": " + mpv_error_string(retcode));
-            // TODO: still returning `data`. This sucks. Make a `MPVError` class and throw it
+    void handlePropertyChange(mpv_event const & event);
+    void handleCommandReply(mpv_event const & event);
+
+    // Commands never run on the calling thread, so that callers never wait on mpv's locks
+    template<typename... Ts>
+    void queueCommand(Completion done, Ts&&... args) {
+        {
+            std::lock_guard lock(_commandsMutex);
+            _commands.push_back(Command{{std::string(std::forward<Ts>(args))...}, std::move(done)});
         }
-        return data;
+        wake();
     }
-
-    template<typename T>
-    int setProperty(char const * name, T&& data) {
-        typename Format<T>::type mpvData = std::forward<T>(data);
-        int retcode = mpv_set_property(_mpv, name, Format<T>::format, &mpvData);
-        if (retcode < 0) {
-            spdlog::get("logger")->error("Error setting MPV property " + std::string(name) + ": " + mpv_error_string(retcode));
-        }
-        return retcode;
-    }
-
+    void wake(); // Makes `fd` readable, so that the owner calls `handleEvents`
+    void submitCommands();
 
 public:
-    Player();
+    Player(std::function<void()> onStatusChange);
     ~Player();
-    void run();
-    void stop();
 
-    void appendMusic(Music const & music);
-    void next();
-    void pause();
-    void play();
-    void seek(double seconds);
+    int fd() const { return _wakeup; } // Becomes readable when `handleEvents` has work to do
+    void handleEvents(); // Processes all pending mpv events and queued commands, without waiting
+    bool shutDown() const { return _shutDown; } // Nothing can be played anymore once it is
+    // When the last track ended, if that hasn't been asked since; for measuring track handoffs
+    std::optional<std::chrono::steady_clock::time_point> takeEndOfFile() {
+        return std::exchange(_endOfFile, std::nullopt);
+    }
+
+    // These can be called from any thread, and return before the command is executed
+    void appendMusic(Music const & music, Completion done = {});
+    void next(Completion done = {});
+    void pause(Completion done = {});
+    void play(Completion done = {});
+    void seek(double seconds, Completion done = {});
+
+    // These never wait on mpv, and can be called from any thread
+    std::shared_ptr<State const> state() const { return std::atomic_load(&_state); }
+    unsigned playlistSize() const { return state()->playlist->size(); }
 
-    unsigned playlistSize() const;
+    // Reads the position from mpv, which briefly waits on it; meant for heartbeats
     nlohmann::json status() const;
 };
 
@@ -2,11 +2,13 @@
 #define PLAYLIST_HPP
 
 #include <algorithm>
+#include <iterator>
 #include <random>
 #include <string>
 #include <vector>
 
 
+// IDs must be dense integers, since they index the membership bitmap
 template<typename ID>
 class Playlist {
 public:
@@ -15,7 +17,8 @@ public:
 private:
     std::string _password;
 
-    std::vector<ID> _musics;
+    std::vector<ID> _musics; // Shuffled in place as musics are picked
+    std::vector<bool> _members; // Indexed by ID, tells which are in `_musics` without scanning it
     std::minstd_rand _rng;
     int _remaining; // How many musics until re-shuffle
 
@@ -24,17 +27,32 @@ private:
 
 public:
     Playlist(std::string const & password)
-     : _password(password), _remaining(0), _subscribers(0) {}
+     : _password(password), _musics(), _members(), _remaining(0), _subscribers(0) {}
 
-    bool checkPassword(std::string const & password) { return password == _password; }
+    // Playlists created without a password (by trusted clients) can't be unlocked with one
+    bool checkPassword(std::string const & password) {
+        return !_password.empty() && password == _password;
+    }
+    std::string const & password() const { return _password; } // For persisting it
+    std::vector<ID> const & musics() const { return _musics; }
     bool empty() const { return _musics.empty(); }
     bool isSubscribed() const { return  _subscribers && !empty(); }
 
     void addMusic(ID const & id) {
-        if (std::find(_musics.cbegin(), _musics.cend(), id) == _musics.cend()) {
+        if (id >= _members.size()) _members.resize(id + 1);
+        if (!_members[id]) {
+            _members[id] = true;
             _musics.push_back(id);
         }
     }
+    template<typename Iterator>
+    void addMusics(Iterator begin, Iterator end) {
+        // Make room once, rather than growing repeatedly during large imports, but still
+        // geometrically, so that many small imports don't each reallocate the playlist
+        std::size_t const needed = _musics.size() + std::distance(begin, end);
+        if (needed > _musics.capacity()) _musics.reserve(std::max(needed, 2 * _musics.capacity()));
+        for (; begin != end; ++begin) addMusic(*begin);
+    }
     ID const & nextMusic() {
         if (empty()) { throw NoMoreMusic(); }
 
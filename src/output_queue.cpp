@@ -0,0 +1,72 @@
+
+#include <algorithm>
+
+#include "output_queue.hpp"
+
+
+OutputQueue::OutputQueue(std::atomic_size_t & totalBytes)
+ : _entries(), _offset(0), _locked(0), _bytes(0), _totalBytes(totalBytes) {}
+
+OutputQueue::~OutputQueue() {
+    _totalBytes -= _bytes;
+}
+
+
+bool OutputQueue::hasHeartbeat() const {
+    return std::any_of(_entries.begin() + std::min(_locked, _entries.size()), _entries.end(),
+                       [](Entry const & entry){ return entry.heartbeat; });
+}
+
+std::size_t OutputQueue::push(Buffer data, bool heartbeat) {
+    std::size_t dropped = 0;
+    if (heartbeat) {
+        // A heartbeat that started being sent must be finished, though
+        std::size_t first = std::max(_locked, std::size_t(_offset != 0));
+        auto stale = std::stable_partition(_entries.begin() + std::min(first, _entries.size()),
+                                           _entries.end(),
+                                           [](Entry const & entry){ return !entry.heartbeat; });
+        for (auto iter = stale; iter != _entries.end(); ++iter) {
+            _bytes -= iter->data->size();
+            _totalBytes -= iter->data->size();
+            ++dropped;
+        }
+        _entries.erase(stale, _entries.end());
+    }
+
+    _bytes += data->size();
+    _totalBytes += data->size();
+    _entries.push_back(Entry{std::move(data), heartbeat});
+    return dropped;
+}
+
+std::size_t OutputQueue::fill(struct iovec * iovecs, std::size_t max) {
+    std::size_t count = std::min({max, maxBatch, _entries.size()});
+    for (std::size_t i = 0; i < count; ++i) {
+        std::string const & data = *_entries[i].data;
+        std::size_t skip = i == 0 ? _offset : 0;
+        iovecs[i].iov_base = const_cast<char *>(data.data() + skip);
+        iovecs[i].iov_len = data.size() - skip;
+    }
+    _locked = count;
+    return count;
+}
+
+void OutputQueue::consume(std::size_t size) {
+    _bytes -= size;
+    _totalBytes -= size;
+    _offset += size;
+    while (!_entries.empty() && _offset >= _entries.front().data->size()) {
+        _offset -= _entries.front().data->size();
+        _entries.pop_front();
+    }
+    _locked = 0;
+}
+
+void OutputQueue::dropUnsent() {
+    std::size_t kept = std::max(_locked, std::size_t(_offset != 0));
+    while (_entries.size() > kept) {
+        _bytes -= _entries.back().data->size();
+        _totalBytes -= _entries.back().data->size();
+        _entries.pop_back();
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef OUTPUT_QUEUE_HPP
+#define OUTPUT_QUEUE_HPP
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+
+
+// Data waiting to be sent to a client, handed to the kernel in batches
+// Heartbeats still waiting when a newer one is queued are stale, and get dropped
+class OutputQueue {
+public:
+    using Buffer = std::shared_ptr<std::string const>;
+
+    static std::size_t constexpr maxBatch = 64; // How many buffers `fill` hands out at most
+
+private:
+    struct Entry {
+        Buffer data;
+        bool heartbeat;
+    };
+    std::deque<Entry> _entries;
+    std::size_t _offset; // How much of the first entry has been sent already
+    std::size_t _locked; // How many leading entries were handed out by `fill`, and can't be dropped
+    std::size_t _bytes; // How much is left to send
+    std::atomic_size_t & _totalBytes; // Shared by all queues of a loop, for statistics
+
+public:
+    OutputQueue(std::atomic_size_t & totalBytes);
+    ~OutputQueue();
+    OutputQueue(OutputQueue const &) = delete;
+    OutputQueue & operator=(OutputQueue const &) = delete;
+
+    bool empty() const { return _entries.empty(); }
+    std::size_t size() const { return _entries.size(); }
+    std::size_t bytes() const { return _bytes; }
+    bool hasHeartbeat() const; // Whether a queued heartbeat would be replaced by a new one
+
+    std::size_t push(Buffer data, bool heartbeat); // Returns how many stale heartbeats were dropped
+    std::size_t fill(struct iovec * iovecs, std::size_t max); // Returns how many were filled
+    void consume(std::size_t size); // To be called once the kernel is done with what `fill` gave
+    void dropUnsent(); // Drops everything but what the kernel may still be using
+};
+
+
+#endif
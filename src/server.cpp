@@ -1,34 +1,117 @@
 
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <cerrno>
 #include <csignal>
+#include <cstring>
 #include <algorithm>
 #include <array>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 #include <stdexcept>
 
 #include "client_connection.hpp"
 #include "config_manager.hpp"
+#include "event_loop.hpp"
 #include "server.hpp"
 
 
 // The signals we stop the server on
 static std::array const handledSignals = {SIGINT, SIGTERM};
-static std::array<struct sigaction, handledSignals.size()> oldact;
+static sigset_t oldSignalMask;
 
 static Server * serverInstance = nullptr;
 
 
-static int const queue_length = 32;
-void Server::tryConnectSocket(std::string const & port, struct addrinfo const * hints,
-                              char const * protocol) {
+// Blocks the signals we stop on, and returns a signalfd to receive them from instead
+// Threads inherit the signal mask, so this must happen before any is started; otherwise,
+// signals could be delivered to a thread not blocking them, and kill the process
+static int blockSignals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    for (auto const & signal : handledSignals) {
+        sigaddset(&signals, signal);
+    }
+    pthread_sigmask(SIG_BLOCK, &signals, &oldSignalMask);
+    return signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// Resets an eventfd or timerfd, so that it's only readable again once it's signalled again
+static void drain(int fd, char const * name) {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        spdlog::get("logger")->error("server.run() {} read() error: {}", name, strerror(errno));
+    }
+}
+
+
+// Describes how to get from one status to the next, for clients using delta heartbeats
+static nlohmann::json diffStatus(nlohmann::json const & from, nlohmann::json const & to) {
+    nlohmann::json delta{
+        {"seq", to["seq"]}, {"changes", nlohmann::json::object()}, {"queue", nlohmann::json::array()}
+    };
+
+    for (char const * key : {"duration", "pause", "position"}) {
+        if (!from.contains(key) || from[key] != to[key]) {
+            delta["changes"][key] = to[key];
+        }
+    }
+
+    nlohmann::json const & oldQueue = from.contains("playlist") ? from["playlist"] : nlohmann::json::array();
+    nlohmann::json const & newQueue = to["playlist"];
+    auto remove = [&](std::size_t index, std::size_t count) {
+        if (count) delta["queue"].push_back({{"op", "remove"}, {"index", index}, {"count", count}});
+    };
+    auto insert = [&](std::size_t index, std::size_t end) {
+        if (end != index) {
+            delta["queue"].push_back({{"op", "insert"}, {"index", index},
+                                      {"entries", nlohmann::json(newQueue.begin() + index,
+                                                                 newQueue.begin() + end)}});
+        }
+    };
+
+    // The queue almost always changes by tracks finishing at the front and others being appended
+    // at the back, so first check if the new queue starts with the end of the old one
+    std::size_t removed = 0;
+    if (!newQueue.empty()) {
+        while (removed < oldQueue.size() && oldQueue[removed] != newQueue[0]) ++removed;
+    }
+    std::size_t kept = oldQueue.size() - removed;
+    if (kept <= newQueue.size()
+     && std::equal(oldQueue.begin() + removed, oldQueue.end(), newQueue.begin())) {
+        remove(0, removed);
+        insert(kept, newQueue.size());
+        return delta;
+    }
+
+    // Otherwise, replace whatever is between the common prefix and suffix
+    std::size_t prefix = 0;
+    while (prefix < oldQueue.size() && prefix < newQueue.size()
+        && oldQueue[prefix] == newQueue[prefix]) ++prefix;
+    std::size_t suffix = 0;
+    while (suffix < oldQueue.size() - prefix && suffix < newQueue.size() - prefix
+        && oldQueue[oldQueue.size() - 1 - suffix] == newQueue[newQueue.size() - 1 - suffix]) ++suffix;
+    remove(prefix, oldQueue.size() - prefix - suffix);
+    insert(prefix, newQueue.size() - suffix);
+    return delta;
+}
+
+
+int Server::tryOpenListener(std::string const & port, struct addrinfo const * hints,
+                            char const * protocol, int backlog, bool reusePort) {
     struct addrinfo * result;
+    int listener = -1;
 
     int gai_errno = getaddrinfo(NULL, port.c_str(), hints, &result);
     if (gai_errno) {
@@ -39,9 +122,11 @@ void Server::tryConnectSocket(std::string const & port, struct addrinfo const *
         // We now have a list of possible addrinfo structs, try `bind`ing until one succeeds
         for (struct addrinfo * ptr = result; ptr; ptr = ptr->ai_next) {
             nbAttempts++;
-            _socket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+            // The listener is non-blocking, since loops accept from it until it runs dry
+            listener = socket(ptr->ai_family, ptr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                              ptr->ai_protocol);
             // A failure is not a problem
-            if (_socket == -1) {
+            if (listener == -1) {
                 spdlog::get("logger")->debug("Attempt to create {} socket failed, trying next: {}",
                                              protocol, strerror(errno));
                 continue;
@@ -49,164 +134,255 @@ void Server::tryConnectSocket(std::string const & port, struct addrinfo const *
             // If it's an IPv6 socket, try making it dual-stack
             if (ptr->ai_family == AF_INET6) {
                 int zero = 0;
-                if (setsockopt(_socket, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)) == -1) {
+                if (setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)) == -1) {
                     spdlog::get("logger")->warn("Failed to make IPv6 socket dual-stack: {}", strerror(errno));
                 }
             }
+            // Don't let connections from a previous run, lingering in TIME_WAIT, prevent restarting
+            int one = 1;
+            if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+                spdlog::get("logger")->warn("Failed to set SO_REUSEADDR: {}", strerror(errno));
+            }
+            // Several listeners may be bound to the same port, the kernel balancing between them
+            if (reusePort && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+                spdlog::get("logger")->warn("Failed to set SO_REUSEPORT: {}", strerror(errno));
+            }
             // However, a success is a definitive success!
-            if (bind(_socket, ptr->ai_addr, ptr->ai_addrlen) == 0
-             && listen(_socket, queue_length) == 0) break;
+            if (bind(listener, ptr->ai_addr, ptr->ai_addrlen) == 0
+             && listen(listener, backlog) == 0) break;
             spdlog::get("logger")->debug("Attempt to open {} socket failed, trying next: {}",
                                          protocol, strerror(errno));
-            close(_socket); // Clean up the socket we opened
-            _socket = -1; // Revert back to failure state
+            close(listener); // Clean up the socket we opened
+            listener = -1; // Revert back to failure state
         }
         freeaddrinfo(result);
 
-        if (_socket == -1) {
+        if (listener == -1) {
             spdlog::get("logger")->warn("Failure to init {} socket : exhausted all {} options",
                                         protocol, nbAttempts);
         }
     }
+    return listener;
+}
+
+int Server::openUnixListener(int backlog) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (_unixPath.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Property \"unix_socket\" is too long: " + _unixPath);
+    }
+    std::memcpy(addr.sun_path, _unixPath.c_str(), _unixPath.size() + 1);
+
+    // The listener is non-blocking, since loops accept from it until it runs dry
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        throw std::runtime_error("Could not create Unix socket: " + std::string(strerror(errno)));
+    }
+    // A socket left behind by a previous run would prevent binding; anything else is left alone
+    struct stat info;
+    if (stat(_unixPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(_unixPath.c_str());
+    }
+    if (bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1
+     || listen(listener, backlog) == -1) {
+        std::string error = strerror(errno);
+        close(listener);
+        throw std::runtime_error("Could not listen on Unix socket " + _unixPath + ": " + error);
+    }
+    return listener;
 }
 
 Server::Server(ConfigManager & config)
- : _socket(-1), _running(true), _tryAddMusic(true), _player(),
-   _playerThread([&](){_player.run();}), _nextConnectionID(0) {
+ : _listeners(), _unixPath(config.getStr("unix_socket")), _unixListener(-1),
+   _trustedUID(config.getInt("unix_trusted_uid")), _webSocketListener(-1), _signals(blockSignals()), _wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+   _heartbeatTimer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+   _running(true), _tryAddMusic(true), _statusChanged(true),
+   _keepalive(std::chrono::milliseconds(config.getInt("keepalive"))),
+   _maxFrameSize(config.getInt("max_frame")), _maxOutputSize(config.getInt("max_output")),
+   _manager(config.getStr("data_dir")),
+   _player([&](){ requestStatusReport(); }) {
     if (serverInstance) {
         // Running two server instances in the same process doesn't sound reasonable, so nothing
         // is designed to handle it.
         spdlog::get("logger")->critical("Running two server instances in the same process will misbehave!!");
     } else {
         // Register this server instance
-        spdlog::get("logger")->trace("Registering signal handlers...");
-
-        struct sigaction action;
-        action.sa_handler = [](int){ serverInstance->stop(); };
-        sigemptyset(&action.sa_mask);
-        action.sa_flags = 0;
-        for (unsigned i = 0; i < handledSignals.size(); i++) {
-            sigaction(handledSignals[i], &action, &oldact[i]);
-        }
-
         serverInstance = this;
     }
 
+    if (_signals == -1 || _wakeup == -1 || _heartbeatTimer == -1) {
+        throw std::runtime_error(std::string("Failed to create the server's event fds: ")
+                                 + strerror(errno));
+    }
+
     // TODO: also handle SIGPIPE for TCP connections timing out
 
+    // Connections are spread over a fixed set of loops, no matter how many clients there are
+    int nbLoops = config.getInt("threads");
+    // Connection IDs tell which loop they belong to, in a limited amount of bits
+    if (nbLoops < 1 || nbLoops > 1 << ConnectionRegistry::tagBits) {
+        throw std::runtime_error("Property \"threads\" must be between 1 and "
+                                 + std::to_string(1 << ConnectionRegistry::tagBits));
+    }
+    // Each listener is accepted from by its own loop; by default, all loops accept
+    int nbListeners = config.getInt("listeners");
+    if (nbListeners == 0) {
+        nbListeners = nbLoops;
+    } else if (nbListeners < 0 || nbListeners > nbLoops) {
+        throw std::runtime_error("Property \"listeners\" must be between 0 and \"threads\"");
+    }
+    int backlog = config.getInt("backlog");
+
     std::string port = std::to_string(config.getInt("port"));
-    spdlog::get("logger")->trace("Setting up connection on port {}...", port);
+    spdlog::get("logger")->trace("Setting up {} listeners on port {}...", nbListeners, port);
 
     // Try making an IPv6 socket
     struct addrinfo hints = {};
     hints.ai_family = AF_INET6;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
-    tryConnectSocket(port, &hints, "IPv6");
+    char const * protocol = "IPv6";
+    int listener = tryOpenListener(port, &hints, protocol, backlog, nbListeners > 1);
 
-    if (_socket == -1) {
+    if (listener == -1) {
         // Now try again for IPv4
         spdlog::get("logger")->warn("Couldn't set up IPv6 socket, falling back to IPv4");
         hints.ai_family = AF_INET;
-        tryConnectSocket(port, &hints, "IPv4");
+        protocol = "IPv4";
+        listener = tryOpenListener(port, &hints, protocol, backlog, nbListeners > 1);
     }
 
     // Now check if we have at *least* one socket open; otherwise, nothing we can do
-    if (_socket == -1) {
+    if (listener == -1) {
         throw std::runtime_error("Could not open IPv4 or IPv6 socket");
     }
+    _listeners.push_back(listener);
+
+    // The others join the first one on the same port, using SO_REUSEPORT
+    while (_listeners.size() < static_cast<std::size_t>(nbListeners)) {
+        listener = tryOpenListener(port, &hints, protocol, backlog, true);
+        if (listener == -1) {
+            throw std::runtime_error("Could only open " + std::to_string(_listeners.size())
+                                     + " listener sockets out of " + std::to_string(nbListeners));
+        }
+        _listeners.push_back(listener);
+    }
+
+    // Clients on the same host may also go through a Unix socket, skipping the TCP stack
+    if (!_unixPath.empty()) {
+        spdlog::get("logger")->trace("Setting up Unix socket listener at {}...", _unixPath);
+        _unixListener = openUnixListener(backlog);
+    }
+
+    // Browsers can't open raw TCP connections, so they get a port of their own, speaking WebSocket
+    if (int webSocketPort = config.getInt("ws_port"); webSocketPort != 0) {
+        spdlog::get("logger")->trace("Setting up WebSocket listener on port {}...", webSocketPort);
+        _webSocketListener = tryOpenListener(std::to_string(webSocketPort), &hints, protocol,
+                                             backlog, false);
+        if (_webSocketListener == -1) {
+            throw std::runtime_error("Could not open WebSocket listener on port "
+                                     + std::to_string(webSocketPort));
+        }
+    }
+
+    std::string const & backend = config.getStr("io_backend");
+    spdlog::get("logger")->trace("Starting {} {} event loops...", nbLoops, backend);
+    for (int i = 0; i < nbLoops; ++i) {
+        _loops.push_back(EventLoop::create(backend, *this, i));
+    }
+    _nextLoop = 0;
+
+    // The kernel spreads incoming connections over the listeners, and so over their loops
+    for (std::size_t i = 0; i < _listeners.size(); ++i) {
+        _loops[i]->listen(_listeners[i]);
+    }
+    // Local clients are few, one loop is enough for them
+    if (_unixListener != -1) {
+        _loops.back()->listen(_unixListener);
+    }
+    // Its connections are handed out to all loops, so which one accepts doesn't matter
+    if (_webSocketListener != -1) {
+        _loops.front()->listen(_webSocketListener);
+    }
 }
 
 Server::~Server() {
-    spdlog::get("logger")->trace("Signaling player thread...");
-    _player.stop();
-
     if (serverInstance == this) {
-        spdlog::get("logger")->trace("Deregistering signal handlers...");
-
-        for (unsigned i = 0; i < handledSignals.size(); i++) {
-            sigaction(handledSignals[i], &oldact[i], NULL);
-        }
+        spdlog::get("logger")->trace("Unblocking signals...");
+        pthread_sigmask(SIG_SETMASK, &oldSignalMask, nullptr);
 
         serverInstance = nullptr;
     }
 
     // Close the listening sockets
     spdlog::get("logger")->trace("Closing listening sockets...");
-    if (_socket != -1) close(_socket);
-
-    spdlog::get("logger")->trace("Joining player thread...");
-    _playerThread.join();
+    for (int listener : _listeners) {
+        close(listener);
+    }
+    if (_unixListener != -1) {
+        close(_unixListener);
+        unlink(_unixPath.c_str());
+    }
+    if (_webSocketListener != -1) {
+        close(_webSocketListener);
+    }
+    close(_heartbeatTimer);
+    close(_wakeup);
+    close(_signals);
 
     spdlog::get("logger")->trace("~Server() done.");
 }
 
 
 void Server::run() {
-    spdlog::get("logger")->trace("Setting up polling for sockets...");
+    spdlog::get("logger")->trace("Setting up polling...");
 
-    // The arguments to `ppoll`...
-    struct timespec const timeout = { .tv_sec = 0, .tv_nsec = 100000 };
+    // Everything this thread reacts to signals a file descriptor, so it only wakes up when needed
+    enum { PLAYER, WAKEUP, HEARTBEAT, SIGNALS };
     std::array pollfds = {
-        (struct pollfd){ .fd = _socket, .events = POLLIN }
+        (struct pollfd){ .fd = _player.fd(), .events = POLLIN, .revents = 0 },
+        (struct pollfd){ .fd = _wakeup, .events = POLLIN, .revents = 0 },
+        (struct pollfd){ .fd = _heartbeatTimer, .events = POLLIN, .revents = 0 },
+        (struct pollfd){ .fd = _signals, .events = POLLIN, .revents = 0 }
     };
-    // To avoid a race condition, signals being caught need to be blocked during polling
-    sigset_t blockedSignals;
-    sigemptyset(&blockedSignals);
-    for (auto const & signal : handledSignals) {
-        sigaddset(&blockedSignals, signal);
-    }
+    armHeartbeat();
 
     spdlog::get("logger")->info("Up and running!");
 
 
-    std::chrono::steady_clock::time_point lastHeartbeat = std::chrono::steady_clock::now();
+    nlohmann::json lastStatus = nlohmann::json::object(); // What the previous heartbeat reported
+    unsigned long long statusSequence = 0; // Lets delta clients notice if they missed one
     while (_running) {
-        // TODO: sometimes valgrind reports that the `sigmask` argument is incorrect?
-        // How that is even possible beats me.
-        switch (ppoll(pollfds.data(), pollfds.size(), &timeout, &blockedSignals)) {
-            case -1:
-                spdlog::get("logger")->error("server.run() ppoll() error: {}", strerror(errno));
-                // fallthrough
-
-            case 0: // Nothing to do
-                break;
-
-            default:
-                // Check for any errors in file descriptors
-                // I'm not sure how to handle them, but report them in the off chance it happens
-                for (nfds_t i = 0; i < pollfds.size(); i++) {
-                    if (pollfds[i].revents & POLLERR) {
-                        spdlog::get("logger")->error("server.run(): file descr. {} [pollfd index {}] returned error", pollfds[i].fd, i);
-                    }
-                }
-                // Check the listener socket
-                if (pollfds[0].revents & POLLIN) {
-                    handleNewConnection(_socket);
-                }
+        // Sockets are all handled by the loops, only the player and requests from them are here
+        if (poll(pollfds.data(), pollfds.size(), -1) == -1) {
+            if (errno != EINTR) {
+                spdlog::get("logger")->error("server.run() poll() error: {}", strerror(errno));
+            }
+            continue;
         }
 
-        // Check if any connections wish to die
-        {
-            std::lock_guard<std::mutex> lock(_closingReqMutex);
-            while (!_closingRequests.empty()) {
-                handleClosingConnection(_closingRequests.front());
-                _closingRequests.pop();
+        // Handle player events right away, so that the queue is refilled just below
+        if (pollfds[PLAYER].revents & POLLIN) {
+            _player.handleEvents();
+            if (_player.shutDown()) {
+                spdlog::get("logger")->critical("The player is gone, stopping");
+                stop();
             }
         }
-
-        // If it's been long enough, perform a heartbeat
-        {
-            using namespace std::chrono_literals;
-            if (std::chrono::steady_clock::now() - lastHeartbeat > 0.7s) {
-                lastHeartbeat = std::chrono::steady_clock::now();
-
-                if (!_connections.empty()) {
-                    nlohmann::json status = _player.status();
-                    for (auto & connection : _connections) {
-                        connection.heartbeat(status);
-                    }
-                }
+        // The flags telling what to do are read below, this only has to be reset
+        if (pollfds[WAKEUP].revents & POLLIN) {
+            drain(_wakeup, "eventfd");
+        }
+        bool keepalive = false;
+        if (pollfds[HEARTBEAT].revents & POLLIN) {
+            drain(_heartbeatTimer, "timerfd");
+            keepalive = true;
+        }
+        if (pollfds[SIGNALS].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(_signals, &info, sizeof(info)) == sizeof(info)) {
+                spdlog::get("logger")->info("Caught {}, stopping", strsignal(info.ssi_signo));
+                stop();
             }
         }
 
@@ -216,18 +392,60 @@ void Server::run() {
                 // Only act if there is at least one playlist
                 Music music = _manager.nextMusic();
                 appendMusic(music);
+
+                if (auto endOfFile = _player.takeEndOfFile(); endOfFile) {
+                    auto handoff = std::chrono::steady_clock::now() - *endOfFile;
+                    spdlog::get("logger")->debug("Track handoff took {} us",
+                        std::chrono::duration_cast<std::chrono::microseconds>(handoff).count());
+                }
             } catch (decltype(_manager)::NoMoreMusic const &) {
                 // If adding music failed, don't try again until there's a chance
                 _tryAddMusic = false;
             }
         }
+
+        // If the status changed, or it's been long enough, perform a heartbeat
+        // Reset the flag first, so changes happening while reporting are not missed
+        {
+            if (_statusChanged.exchange(false) || keepalive) {
+                armHeartbeat(); // The keepalive counts from the last heartbeat, whatever its cause
+
+                if (std::any_of(_loops.begin(), _loops.end(),
+                                [](auto const & loop){ return !loop->empty(); })) {
+                    nlohmann::json status = _player.status();
+                    status["seq"] = ++statusSequence;
+                    // Serialize once, all connections will share the same buffers
+                    auto heartbeats = std::make_shared<ClientConnection::Heartbeats const>(
+                        ClientConnection::serializeHeartbeats(status, diffStatus(lastStatus, status),
+                                                              _webSocketListener != -1)
+                    );
+                    lastStatus = std::move(status);
+                    for (auto & loop : _loops) {
+                        loop->heartbeat(heartbeats);
+                    }
+                }
+
+                // Report on output buffering at the keepalive's pace, not at every status change
+                if (keepalive) {
+                    std::size_t queuedBytes = 0, droppedHeartbeats = 0, slowDisconnects = 0;
+                    for (auto & loop : _loops) {
+                        queuedBytes += loop->stats().queuedBytes;
+                        droppedHeartbeats += loop->stats().droppedHeartbeats;
+                        slowDisconnects += loop->stats().slowDisconnects;
+                    }
+                    spdlog::get("logger")->debug("Output: {} bytes queued, {} stale heartbeats "
+                                                 "dropped, {} slow clients disconnected",
+                                                 queuedBytes, droppedHeartbeats, slowDisconnects);
+                }
+            }
+        }
     }
 
     spdlog::get("logger")->info("Cleaning up connections...");
 
-    // Signal all connections they must terminate
-    for (ClientConnection & connection : _connections) {
-        connection.stop();
+    // Signal all loops they must terminate; they will clean up their connections
+    for (auto & loop : _loops) {
+        loop->stop();
     }
 
     spdlog::get("logger")->trace("server.run() done.");
@@ -235,47 +453,74 @@ void Server::run() {
 
 void Server::stop() {
     _running = false;
+    wake();
 }
 
+void Server::wake() {
+    uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        spdlog::get("logger")->error("Server eventfd write() error: {}", strerror(errno));
+    }
+}
 
-void Server::addWishToDie(ConnectionID id) {
-    std::lock_guard<std::mutex> lock(_closingReqMutex);
-    _closingRequests.push(id);
+void Server::armHeartbeat() {
+    auto const keepaliveNs = std::chrono::duration_cast<std::chrono::nanoseconds>(_keepalive).count();
+    struct itimerspec const timer = {
+        .it_interval = {}, // Rearmed after each heartbeat instead
+        .it_value = { .tv_sec = keepaliveNs / 1000000000, .tv_nsec = keepaliveNs % 1000000000 }
+    };
+    if (timerfd_settime(_heartbeatTimer, 0, &timer, nullptr) == -1) {
+        spdlog::get("logger")->error("Server timerfd_settime() error: {}", strerror(errno));
+    }
 }
 
 
-void Server::handleNewConnection(int socket) {
+void Server::handleNewConnection(int listener, int socket, EventLoop & acceptor) {
     struct sockaddr_storage addr;
     socklen_t addr_size = sizeof(addr);
-    int new_socket = accept(socket, reinterpret_cast<struct sockaddr *>(&addr), &addr_size);
-    if (new_socket == -1) {
-        spdlog::get("logger")->error("accept() error: {}", strerror(errno));
-        return;
+    if (getpeername(socket, reinterpret_cast<struct sockaddr *>(&addr), &addr_size) == -1) {
+        spdlog::get("logger")->error("getpeername() error: {}", strerror(errno));
+        addr.ss_family = AF_UNSPEC;
     }
-
+    // The connection's ID is only known once a loop has taken it, so it logs this
+    std::string peer;
+    bool trusted = false;
     if (addr.ss_family == AF_INET) {
         struct sockaddr_in const * addrv4 = reinterpret_cast<struct sockaddr_in *>(&addr);
         uint32_t ip4 = ntohl(addrv4->sin_addr.s_addr);
-        spdlog::get("logger")->info("Accepted connection {} from address {}.{}.{}.{}:{}",
-                                    _nextConnectionID,
-                                    ip4 >> 24, ip4 >> 16 & 255, ip4 >> 8 & 255, ip4 & 255,
-                                    ntohs(addrv4->sin_port));
+        peer = fmt::format("address {}.{}.{}.{}:{}",
+                           ip4 >> 24, ip4 >> 16 & 255, ip4 >> 8 & 255, ip4 & 255,
+                           ntohs(addrv4->sin_port));
     } else if (addr.ss_family == AF_INET6) {
         struct sockaddr_in6 const * addrv6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
         unsigned char const * ip6 = addrv6->sin6_addr.s6_addr;
-        spdlog::get("logger")->info("Accepted connection {} from address {:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x} port {}", _nextConnectionID, ip6[0], ip6[1], ip6[2], ip6[3], ip6[4], ip6[5], ip6[6], ip6[7], ip6[8], ip6[9], ip6[10], ip6[11], ip6[12], ip6[13], ip6[14], ip6[15], ntohs(addrv6->sin6_port));
+        peer = fmt::format("address {:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x}:{:0>2x} port {}", ip6[0], ip6[1], ip6[2], ip6[3], ip6[4], ip6[5], ip6[6], ip6[7], ip6[8], ip6[9], ip6[10], ip6[11], ip6[12], ip6[13], ip6[14], ip6[15], ntohs(addrv6->sin6_port));
+    } else if (addr.ss_family == AF_UNIX) {
+        // Unix sockets tell who is on the other end, which decides whether to trust them
+        struct ucred credentials;
+        socklen_t size = sizeof(credentials);
+        if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == -1) {
+            spdlog::get("logger")->error("getsockopt(SO_PEERCRED) error: {}", strerror(errno));
+            peer = "local process";
+        } else {
+            peer = fmt::format("local process {} (uid {})", credentials.pid, credentials.uid);
+            trusted = _trustedUID >= 0 && credentials.uid == static_cast<uid_t>(_trustedUID);
+        }
     } else {
-        spdlog::get("logger")->warn("Accepted connection {} of unknown type {}",
-                                    _nextConnectionID, addr.ss_family);
+        spdlog::get("logger")->warn("Accepted connection of unknown type {}", addr.ss_family);
+        peer = "unknown address";
     }
 
-    _connections.emplace(_connections.begin(), new_socket, *this, _nextConnectionID);
-    ++_nextConnectionID;
-}
-
+    auto transport = ClientConnection::Transport::STREAM;
+    if (listener == _webSocketListener) {
+        transport = ClientConnection::Transport::WEBSOCKET_HANDSHAKE;
+        peer += " over WebSocket";
+    }
 
-void Server::handleClosingConnection(ConnectionID id) {
-    _connections.remove_if([&id](ClientConnection const & connection) {
-        return connection.id() == id;
-    });
+    // If all loops accept, the kernel already balanced connections between them, so they're kept
+    // by their acceptor; otherwise (or for the single WebSocket listener), they are handed out to
+    // all loops round-robin
+    bool const balanced = _listeners.size() == _loops.size() && listener != _webSocketListener;
+    EventLoop & loop = balanced ? acceptor : *_loops[_nextLoop++ % _loops.size()];
+    loop.addConnection(socket, std::move(peer), trusted, transport);
 }
@@ -3,55 +3,72 @@
 
 #include <atomic>
 #include <chrono>
-#include <mutex>
-#include <list>
-#include <queue>
-#include <thread>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "music/music_manager.hpp"
 #include "music/player.hpp"
 
 
-class ClientConnection;
 class ConfigManager;
+class EventLoop;
 
 struct addrinfo;
 
 class Server {
 public:
-    // FIXME: Using a sequence of IDs is kinda sucky because there can be conflicts
-    //        due to overflow; however, this is not a context in which it's important
-    using ConnectionID = unsigned long long;
+    // Handed out by each loop's `ConnectionRegistry`, which makes sure a stale one is never reused
+    using ConnectionID = std::uint64_t;
 
 
 private:
-    int _socket; // File descriptor for the listener socket
+    std::vector<int> _listeners; // Listener sockets, all on the same port; each has its own loop
+    std::string _unixPath; // Where the Unix socket listener is bound, if there is one
+    int _unixListener; // -1 if there is none
+    int _trustedUID; // Clients connecting through the Unix socket with this UID are trusted
+    int _webSocketListener; // Accepts browser clients, speaking WebSocket; -1 if there is none
+    // What the server's thread waits on; these come first, so signals are blocked before any thread
+    // is started
+    int _signals; // signalfd for SIGINT and SIGTERM
+    int _wakeup; // eventfd written to when one of the flags below is set
+    int _heartbeatTimer; // timerfd expiring when a keepalive heartbeat is due
 
     std::atomic_bool _running; // Set to false when the server recieves SIGTERM
 
     std::atomic_bool _tryAddMusic; // Set to false when failing to add music
+    std::atomic_bool _statusChanged; // Set by the player when a status report should be sent now
+    std::chrono::steady_clock::duration _keepalive; // Max time between two status reports
+    std::size_t _maxFrameSize; // Clients sending larger packets are disconnected
+    std::size_t _maxOutputSize; // Clients letting more than this pile up are disconnected
     MusicManager _manager;
 
     Player _player;
-    std::thread _playerThread;
 
-    std::mutex _closingReqMutex; // Mutex for modifying what's below
-    std::queue<ConnectionID> _closingRequests; // The IDs of the connections wishing to die
-    ConnectionID _nextConnectionID; // The ID of the next connection to be generated
-    std::list<ClientConnection> _connections;
-
-    void tryConnectSocket(std::string const & port, struct addrinfo const * hints,
-                          char const * protocol);
+    // The loops connections are dispatched to; declared last so they are destroyed first
+    std::vector<std::unique_ptr<EventLoop>> _loops;
+    // Counts connections handed out, when not all loops accept; incremented by all acceptors
+    std::atomic_size_t _nextLoop;
+
+    // Returns the listener socket, or -1
+    int tryOpenListener(std::string const & port, struct addrinfo const * hints,
+                        char const * protocol, int backlog, bool reusePort);
+    int openUnixListener(int backlog); // Throws on failure
+    void wake(); // Interrupts the server thread's waiting, so it checks the flags again
+    void armHeartbeat(); // (Re)starts the keepalive countdown
 public:
     Server(ConfigManager & config);
     ~Server();
 
     void run(); // Loops infinitely until stopped, handling incoming connections
     void stop(); // Signals the server to stop, but doesn't kill it immediately
-    void addWishToDie(ConnectionID id); // Call to request a ClientConnection's destruction
-private:
-    void handleNewConnection(int socket); // Accepts a connection on the given socket
-    void handleClosingConnection(ConnectionID id); // Destroy a connection object from its ID
+    // Have all clients be sent the status ASAP
+    void requestStatusReport() { _statusChanged = true; wake(); }
+    std::size_t maxFrameSize() const { return _maxFrameSize; }
+    std::size_t maxOutputSize() const { return _maxOutputSize; }
+    // Hands a socket freshly accepted from `listener` to a loop; called from the thread of `acceptor`
+    void handleNewConnection(int listener, int socket, EventLoop & acceptor);
 
 public:
     bool playlistExists(std::string const & name) const { return _manager.playlistExists(name); }
@@ -59,15 +76,28 @@ public:
     void addMusic(std::string const & playlist, Music const & music) {
         _manager.addMusic(playlist, music);
         _tryAddMusic = true;
+        wake();
+    }
+    void addMusics(std::string const & playlist, std::vector<Music> const & musics) {
+        _manager.addMusics(playlist, musics);
+        _tryAddMusic = true;
+        wake();
+    }
+    // Player commands are executed asynchronously, `done` is called from the server's thread
+    void appendMusic(Music const & music, Player::Completion done = {}) {
+        _player.appendMusic(music, std::move(done));
     }
-    void appendMusic(Music const & music) { _player.appendMusic(music); }
     void newPlaylist(std::string const & name, std::string const & pass) {
         _manager.newPlaylist(name, pass);
     }
-    void pause() { _player.pause(); }
-    void play() { _player.play(); }
-    void seek(double seconds) { _player.seek(seconds); }
-    void subscribe(std::string const & name) { _manager.subscribe(name); _tryAddMusic = true; }
+    void pause(Player::Completion done) { _player.pause(std::move(done)); }
+    void play(Player::Completion done) { _player.play(std::move(done)); }
+    void seek(double seconds, Player::Completion done) { _player.seek(seconds, std::move(done)); }
+    void subscribe(std::string const & name) {
+        _manager.subscribe(name);
+        _tryAddMusic = true;
+        wake();
+    }
     void unsubscribe(std::string const & name) { _manager.unsubscribe(name); }
 };
 
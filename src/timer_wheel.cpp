@@ -0,0 +1,121 @@
+
+#include <algorithm>
+
+#include "timer_wheel.hpp"
+
+
+using namespace std::literals::chrono_literals;
+TimerWheel::Clock::duration const TimerWheel::resolution = 10ms;
+
+
+TimerWheel::Timer::Timer(std::function<void()> callback)
+ : _callback(std::move(callback)), _expiry(0), _next(nullptr), _pprev(nullptr) {}
+
+void TimerWheel::Timer::cancel() {
+    if (!_pprev) return;
+
+    *_pprev = _next;
+    if (_next) {
+        _next->_pprev = _pprev;
+    }
+    _next = nullptr;
+    _pprev = nullptr;
+}
+
+
+TimerWheel::TimerWheel() : _start(Clock::now()), _tick(0), _slots() {}
+
+
+void TimerWheel::schedule(Timer & timer, Clock::duration delay) {
+    timer.cancel();
+    // The current tick has already partly elapsed, so count from the next one
+    timer._expiry = ticks(Clock::now() + delay) + 1;
+    insert(timer);
+}
+
+void TimerWheel::advance(Clock::time_point now) {
+    std::uint64_t const target = ticks(now);
+    while (_tick < target) {
+        // Ticks with nothing to do are skipped, however many went by while idle
+        std::optional<std::uint64_t> const next = nextBusyTick();
+        if (!next || *next > target) {
+            _tick = target;
+            break;
+        }
+        _tick = *next;
+        // Each time a level wraps around, the next slot of the level above is due for a closer look
+        for (unsigned level = 1; level < nbLevels; ++level) {
+            if (_tick & ((std::uint64_t(1) << (level * slotBits)) - 1)) break;
+            cascade(level);
+        }
+
+        // Callbacks may schedule or cancel timers, so the slot is re-read every time
+        Timer * & slot = _slots[0][_tick & (nbSlots - 1)];
+        while (slot) {
+            Timer & timer = *slot;
+            timer.cancel();
+            timer._callback();
+        }
+    }
+}
+
+std::optional<TimerWheel::Clock::duration> TimerWheel::nextExpiry(Clock::time_point now) const {
+    std::optional<std::uint64_t> const next = nextBusyTick();
+    if (!next) return std::nullopt;
+    Clock::time_point const time = _start + resolution * static_cast<Clock::rep>(*next);
+    return std::max(Clock::duration::zero(), time - now);
+}
+
+
+std::uint64_t TimerWheel::ticks(Clock::time_point time) const {
+    return time <= _start ? 0 : (time - _start) / resolution;
+}
+
+std::optional<std::uint64_t> TimerWheel::nextBusyTick() const {
+    // A level's first non-empty slot tells when something will happen there, be it firing or
+    // cascading, but a higher level may still cascade earlier than a lower one fires
+    std::optional<std::uint64_t> next;
+    for (unsigned level = 0; level < nbLevels; ++level) {
+        unsigned const shift = level * slotBits;
+        for (std::uint64_t slot = (_tick >> shift) + 1; slot <= (_tick >> shift) + nbSlots; ++slot) {
+            if (_slots[level][slot & (nbSlots - 1)]) {
+                next = std::min(next.value_or(slot << shift), slot << shift);
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+void TimerWheel::insert(Timer & timer) {
+    // Only cascading can come across timers due now, and `advance` fires that slot right after
+    std::uint64_t expiry = std::max(timer._expiry, _tick);
+    std::uint64_t const delta = expiry - _tick;
+
+    // The level is the one whose slots are just coarse enough for the timer to fit
+    unsigned level = 0;
+    while (level + 1 < nbLevels && delta >= std::uint64_t(1) << ((level + 1) * slotBits)) {
+        ++level;
+    }
+    std::uint64_t const range = std::uint64_t(1) << (nbLevels * slotBits);
+    if (delta >= range) {
+        expiry = _tick + range - 1; // Parked as far as possible, it'll be placed again from there
+    }
+
+    Timer * & slot = _slots[level][(expiry >> (level * slotBits)) & (nbSlots - 1)];
+    timer._next = slot;
+    timer._pprev = &slot;
+    if (slot) {
+        slot->_pprev = &timer._next;
+    }
+    slot = &timer;
+}
+
+void TimerWheel::cascade(unsigned level) {
+    Timer * & slot = _slots[level][(_tick >> (level * slotBits)) & (nbSlots - 1)];
+    while (slot) {
+        Timer & timer = *slot;
+        timer.cancel();
+        insert(timer);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+
+
+// Fires callbacks once their deadline has passed, at a coarse resolution
+// Timers sit in a hierarchy of wheels: far away ones are only moved a few times before firing,
+// and (re)scheduling or cancelling one is O(1), so idle timers cost next to nothing
+// Not thread-safe; each event loop has its own, only used from its thread
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    static Clock::duration const resolution;
+
+    // A callback which can be scheduled on a wheel any number of times; it's cancelled on destruction
+    // It must not outlive the wheel, and must not be destroyed by its own callback
+    class Timer {
+        friend class TimerWheel;
+
+        std::function<void()> _callback;
+        std::uint64_t _expiry; // The tick at which to fire
+        // Timers sharing a slot form a list; `_pprev` points to whatever points to this
+        Timer * _next;
+        Timer ** _pprev;
+
+    public:
+        Timer(std::function<void()> callback);
+        Timer(Timer const &) = delete;
+        Timer & operator=(Timer const &) = delete;
+        ~Timer() { cancel(); }
+
+        bool scheduled() const { return _pprev != nullptr; }
+        void cancel();
+    };
+
+private:
+    static unsigned constexpr slotBits = 6;
+    static std::size_t constexpr nbSlots = 1 << slotBits;
+    static unsigned constexpr nbLevels = 4; // Timers further away are re-cascaded until they fit
+
+    Clock::time_point _start; // Tick 0
+    std::uint64_t _tick; // The last tick processed
+    std::array<std::array<Timer *, nbSlots>, nbLevels> _slots;
+
+public:
+    TimerWheel();
+    TimerWheel(TimerWheel const &) = delete;
+    TimerWheel & operator=(TimerWheel const &) = delete;
+
+    // Fires `timer` after `delay` (never earlier, at most one tick later); reschedules it if needed
+    void schedule(Timer & timer, Clock::duration delay);
+    // Fires every timer whose deadline has passed at `now`
+    void advance(Clock::time_point now);
+    // How long until `advance` has something to do, or nothing if no timer is scheduled
+    std::optional<Clock::duration> nextExpiry(Clock::time_point now) const;
+
+private:
+    std::uint64_t ticks(Clock::time_point time) const;
+    // The first tick after the current one with timers to fire or cascade, if any
+    std::optional<std::uint64_t> nextBusyTick() const;
+    void insert(Timer & timer);
+    void cascade(unsigned level); // Redistributes the current slot of `level` to lower ones
+};
+
+
+#endif
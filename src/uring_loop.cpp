@@ -0,0 +1,352 @@
+
+#ifdef MUSICBOTD_IO_URING
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "uring_loop.hpp"
+
+
+UringLoop::UringLoop(Server & server, unsigned index)
+ : EventLoop(server, index), _bufRing(nullptr), _buffers(nbBuffers * bufferSize),
+   // Not non-blocking, otherwise io_uring reports EAGAIN instead of waiting for it
+   _wakeup(eventfd(0, EFD_CLOEXEC)), _wakeupCount(0), _listeners(), _slots() {
+    if (_wakeup == -1) {
+        throw std::runtime_error("Failed to create eventfd: " + std::string(strerror(errno)));
+    }
+
+    int retcode = io_uring_queue_init(queueDepth, &_ring, 0);
+    if (retcode < 0) {
+        close(_wakeup);
+        throw std::runtime_error("Failed to create io_uring: " + std::string(strerror(-retcode)));
+    }
+
+    // Register the buffers the kernel will pick from when receiving
+    _bufRing = io_uring_setup_buf_ring(&_ring, nbBuffers, bufferGroup, 0, &retcode);
+    if (!_bufRing) {
+        io_uring_queue_exit(&_ring);
+        close(_wakeup);
+        throw std::runtime_error("Failed to set up provided buffers: " + std::string(strerror(-retcode)));
+    }
+    for (unsigned i = 0; i < nbBuffers; ++i) {
+        io_uring_buf_ring_add(_bufRing, &_buffers[i * bufferSize], bufferSize, i,
+                              io_uring_buf_ring_mask(nbBuffers), i);
+    }
+    io_uring_buf_ring_advance(_bufRing, nbBuffers);
+
+    // Multishot recv came after provided buffers, and failing now lets the server use epoll instead
+    if (!supportsMultishotRecv()) {
+        io_uring_free_buf_ring(&_ring, _bufRing, nbBuffers, bufferGroup);
+        io_uring_queue_exit(&_ring);
+        close(_wakeup);
+        throw std::runtime_error("Multishot recv is not supported (requires Linux 6.0+)");
+    }
+
+    submitWakeup();
+
+    start();
+}
+
+UringLoop::~UringLoop() {
+    shutdown();
+
+    // This cancels everything still in flight
+    io_uring_free_buf_ring(&_ring, _bufRing, nbBuffers, bufferGroup);
+    io_uring_queue_exit(&_ring);
+    close(_wakeup);
+}
+
+
+bool UringLoop::supportsMultishotRecv() {
+    // There is no feature flag for it, so try it on a socket pair with a byte waiting, then closed
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) return false;
+    char const byte = 0;
+    bool const written = write(pair[1], &byte, 1) == 1;
+    close(pair[1]);
+    if (!written) {
+        close(pair[0]);
+        return false;
+    }
+
+    struct io_uring_sqe * sqe = getSqe(Operation::RECV);
+    io_uring_prep_recv_multishot(sqe, pair[0], nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufferGroup;
+    io_uring_submit(&_ring);
+
+    // Kernels without it either reject it, or treat it as a single recv which doesn't flag more
+    bool supported = false;
+    bool more = true;
+    while (more) {
+        struct io_uring_cqe * cqe;
+        int retcode = io_uring_wait_cqe(&_ring, &cqe);
+        if (retcode == -EINTR) continue;
+        if (retcode < 0) break;
+
+        if (cqe->res > 0 && cqe->flags & IORING_CQE_F_MORE) supported = true;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned short bufferID = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            io_uring_buf_ring_add(_bufRing, &_buffers[bufferID * bufferSize], bufferSize, bufferID,
+                                  io_uring_buf_ring_mask(nbBuffers), 0);
+            io_uring_buf_ring_advance(_bufRing, 1);
+        }
+        more = cqe->flags & IORING_CQE_F_MORE;
+        io_uring_cqe_seen(&_ring, cqe);
+    }
+    close(pair[0]);
+    return supported;
+}
+
+
+void UringLoop::run() {
+    while (_running) {
+        // Only wake up for timeouts when one is due
+        struct __kernel_timespec timeout = {};
+        auto const wait = nextTimeout();
+        if (wait) {
+            auto const waitNs = std::chrono::ceil<std::chrono::nanoseconds>(*wait).count();
+            timeout.tv_sec = waitNs / 1000000000;
+            timeout.tv_nsec = waitNs % 1000000000;
+        }
+
+        // Everything queued since last iteration goes out in a single syscall
+        struct io_uring_cqe * cqe;
+        int retcode = io_uring_submit_and_wait_timeout(&_ring, &cqe, 1, wait ? &timeout : nullptr,
+                                                       nullptr);
+        if (retcode < 0 && retcode != -ETIME && retcode != -EINTR) {
+            spdlog::get("logger")->error("EventLoop[{}] io_uring wait error: {}", _index,
+                                         strerror(-retcode));
+        }
+
+        while (io_uring_peek_cqe(&_ring, &cqe) == 0) {
+            struct io_uring_cqe const completion = *cqe;
+            io_uring_cqe_seen(&_ring, cqe); // Free the slot now, handlers may need to submit
+            handleCompletion(completion);
+        }
+
+        afterEvents();
+    }
+}
+
+void UringLoop::wake() {
+    uint64_t one = 1;
+    if (write(_wakeup, &one, sizeof(one)) == -1) {
+        spdlog::get("logger")->error("EventLoop[{}] eventfd write() error: {}", _index,
+                                     strerror(errno));
+    }
+}
+
+void UringLoop::watchListener(int socket) {
+    // io_uring would report EAGAIN instead of waiting if the listener stayed non-blocking
+    int flags = fcntl(socket, F_GETFL);
+    if (flags == -1 || fcntl(socket, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        spdlog::get("logger")->error("EventLoop[{}] failed to make listener blocking: {}", _index,
+                                     strerror(errno));
+        return;
+    }
+    _listeners.push_back(socket);
+    submitAccept(_listeners.size() - 1);
+}
+
+void UringLoop::watchConnection(ClientConnection & connection) {
+    auto [slot, inserted] = _slots.try_emplace(connection.id(), connection, _stats.queuedBytes);
+    submitRecv(connection.id(), std::get<1>(*slot));
+}
+
+void UringLoop::unwatchConnection(ClientConnection & connection) {
+    auto slot = _slots.find(connection.id());
+    if (slot == _slots.end()) return;
+
+    std::get<1>(*slot).connection = nullptr;
+    // Keep what is being sent alive until the kernel is done with it, but drop the rest
+    std::get<1>(*slot).outbox.dropUnsent();
+
+    if (std::get<1>(*slot).pending == 0) {
+        _slots.erase(slot);
+    } else {
+        // Only the recv is cancelled: the send in flight holds on to the socket until it completes,
+        // so the last packet before closing (e.g. an error reply) still goes out
+        // The socket is about to be closed, so the cancellation must be submitted right away
+        struct io_uring_sqe * sqe = getSqe(Operation::CANCEL);
+        io_uring_prep_cancel64(sqe, connection.id() << operationBits
+                                    | static_cast<uint64_t>(Operation::RECV), 0);
+        io_uring_submit(&_ring);
+    }
+}
+
+
+OutputQueue * UringLoop::outputQueue(ClientConnection & connection) {
+    auto slot = _slots.find(connection.id());
+    return slot == _slots.end() ? nullptr : &std::get<1>(*slot).outbox;
+}
+
+void UringLoop::flush(ClientConnection & connection, OutputQueue &) {
+    Slot & slot = _slots.at(connection.id());
+    if (!slot.sending) {
+        submitSend(connection.id(), slot);
+    }
+}
+
+
+struct io_uring_sqe * UringLoop::getSqe(Operation operation, Server::ConnectionID id) {
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&_ring);
+    if (!sqe) {
+        // The submission queue is full, flush it to make room
+        io_uring_submit(&_ring);
+        sqe = io_uring_get_sqe(&_ring);
+        if (!sqe) {
+            throw std::runtime_error("io_uring submission queue is full");
+        }
+    }
+    io_uring_sqe_set_data64(sqe, id << operationBits | static_cast<uint64_t>(operation));
+    return sqe;
+}
+
+void UringLoop::submitWakeup() {
+    io_uring_prep_read(getSqe(Operation::WAKEUP), _wakeup, &_wakeupCount, sizeof(_wakeupCount), 0);
+}
+
+void UringLoop::submitAccept(std::size_t listener) {
+    // The listener's index takes the place of a connection ID
+    io_uring_prep_multishot_accept(getSqe(Operation::ACCEPT, listener), _listeners[listener],
+                                   nullptr, nullptr, SOCK_CLOEXEC);
+}
+
+void UringLoop::submitRecv(Server::ConnectionID id, Slot & slot) {
+    struct io_uring_sqe * sqe = getSqe(Operation::RECV, id);
+    io_uring_prep_recv_multishot(sqe, slot.socket, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufferGroup;
+    ++slot.pending;
+}
+
+void UringLoop::submitSend(Server::ConnectionID id, Slot & slot) {
+    // Buffers are shared, so they're sent in place; `outbox` keeps them alive until completion
+    slot.message = {};
+    slot.message.msg_iov = slot.iovecs.data();
+    slot.message.msg_iovlen = slot.outbox.fill(slot.iovecs.data(), slot.iovecs.size());
+    io_uring_prep_sendmsg(getSqe(Operation::SEND, id), slot.socket, &slot.message, MSG_NOSIGNAL);
+    slot.sending = true;
+    ++slot.pending;
+}
+
+
+void UringLoop::handleCompletion(struct io_uring_cqe const & cqe) {
+    uint64_t userData = io_uring_cqe_get_data64(&cqe);
+    Server::ConnectionID id = userData >> operationBits;
+
+    switch (static_cast<Operation>(userData & ((1 << operationBits) - 1))) {
+        case Operation::WAKEUP:
+            if (cqe.res < 0) {
+                spdlog::get("logger")->error("EventLoop[{}] eventfd read() error: {}", _index,
+                                             strerror(-cqe.res));
+            }
+            runTasks();
+            submitWakeup();
+            break;
+
+        case Operation::ACCEPT:
+            if (cqe.res >= 0) {
+                _server.handleNewConnection(_listeners[id], cqe.res, *this);
+            } else {
+                spdlog::get("logger")->error("accept() error: {}", strerror(-cqe.res));
+            }
+            // Multishot operations may be terminated by the kernel, and must then be re-armed
+            if (!(cqe.flags & IORING_CQE_F_MORE)) submitAccept(id);
+            break;
+
+        case Operation::RECV:
+            handleRecv(id, cqe);
+            break;
+
+        case Operation::SEND:
+            handleSend(id, cqe);
+            break;
+
+        case Operation::CANCEL:
+            // Nothing to do, the cancelled operations complete on their own
+            break;
+    }
+}
+
+void UringLoop::handleRecv(Server::ConnectionID id, struct io_uring_cqe const & cqe) {
+    auto slot = _slots.find(id);
+    Slot * state = slot == _slots.end() ? nullptr : &std::get<1>(*slot);
+    ClientConnection * connection = state ? state->connection : nullptr;
+
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned short bufferID = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        char * buffer = &_buffers[bufferID * bufferSize];
+        if (connection && cqe.res > 0) {
+            dispatch(*connection, [&](){
+                connection->handleData(std::string_view(buffer, cqe.res));
+            });
+        }
+        // Give the buffer back to the kernel
+        io_uring_buf_ring_add(_bufRing, buffer, bufferSize, bufferID,
+                              io_uring_buf_ring_mask(nbBuffers), 0);
+        io_uring_buf_ring_advance(_bufRing, 1);
+    }
+
+    if (connection) {
+        if (cqe.res == 0) {
+            connection->handleHangup();
+        } else if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+            spdlog::get("logger")->error("ClientConnection[{}] recv() error: {}", id,
+                                         strerror(-cqe.res));
+            connection->stop();
+        }
+    }
+
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        // Running out of buffers terminates the multishot, but more will be available soon
+        bool rearm = connection && !connection->stopping() && (cqe.res > 0 || cqe.res == -ENOBUFS);
+        if (rearm) submitRecv(id, *state);
+        if (state) releaseSlot(slot);
+    }
+}
+
+void UringLoop::handleSend(Server::ConnectionID id, struct io_uring_cqe const & cqe) {
+    auto slot = _slots.find(id);
+    if (slot == _slots.end()) return; // Shouldn't happen, since sends keep their slot alive
+    Slot & state = std::get<1>(*slot);
+
+    state.sending = false;
+    if (cqe.res < 0) {
+        if (state.connection && cqe.res != -ECANCELED) {
+            spdlog::get("logger")->error("ClientConnection[{}] send() error: {}", id,
+                                         strerror(-cqe.res));
+            // The connection can't be salvaged, whether the pipe is broken or not
+            state.connection->stop();
+        }
+        state.outbox.consume(0);
+        state.outbox.dropUnsent();
+    } else {
+        // Sends may be partial, the remainder will simply be part of the next one
+        state.outbox.consume(cqe.res);
+    }
+
+    if (!state.outbox.empty() && state.connection) {
+        submitSend(id, state);
+    }
+    releaseSlot(slot);
+}
+
+void UringLoop::releaseSlot(decltype(_slots)::iterator slot) {
+    Slot & state = std::get<1>(*slot);
+    --state.pending;
+    // If the connection is gone, this was the last thing keeping the slot alive
+    if (state.pending == 0 && !state.connection) {
+        _slots.erase(slot);
+    }
+}
+
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef URING_LOOP_HPP
+#define URING_LOOP_HPP
+
+#ifdef MUSICBOTD_IO_URING
+
+#include <liburing.h>
+
+#include <array>
+#include <unordered_map>
+#include <vector>
+
+#include "event_loop.hpp"
+
+
+// Event loop submitting all socket I/O through an io_uring: multishot accept, multishot recv into
+// a ring of provided buffers, and sends batched into a single submission per loop iteration
+// Requires Linux 6.0+ (for multishot recv) and liburing 2.4+
+class UringLoop : public EventLoop {
+public:
+    static unsigned const queueDepth = 256;
+    static unsigned const nbBuffers = 64; // Must be a power of 2
+    static unsigned const bufferSize = 4096;
+    static int const bufferGroup = 0;
+
+private:
+    // What each submission was for, stored in the low bits of its user data
+    enum class Operation : uint64_t { WAKEUP, ACCEPT, RECV, SEND, CANCEL };
+    static unsigned const operationBits = 3;
+
+    // I/O state of a connection; it outlives the connection until its operations complete
+    struct Slot {
+        ClientConnection * connection; // Null once the connection has been destroyed
+        int socket;
+        unsigned pending; // How many operations in flight refer to this slot
+        OutputQueue outbox;
+        bool sending; // Only one send may be in flight, otherwise they could be reordered
+        // What the send in flight refers to; must stay put until it completes
+        struct msghdr message;
+        std::array<struct iovec, OutputQueue::maxBatch> iovecs;
+
+        Slot(ClientConnection & connection, std::atomic_size_t & queuedBytes)
+         : connection(&connection), socket(connection.socket()), pending(0), outbox(queuedBytes),
+           sending(false), message(), iovecs() {}
+    };
+
+    struct io_uring _ring;
+    struct io_uring_buf_ring * _bufRing;
+    std::vector<char> _buffers; // The memory backing the provided buffers
+
+    int _wakeup; // eventfd used to interrupt waiting when tasks are posted
+    uint64_t _wakeupCount; // Where reads from `_wakeup` land
+    std::vector<int> _listeners; // Listener sockets we're accepting from
+
+    std::unordered_map<Server::ConnectionID, Slot> _slots;
+
+public:
+    UringLoop(Server & server, unsigned index);
+    ~UringLoop();
+
+private:
+    void run() override;
+    void wake() override;
+    void watchListener(int socket) override;
+    void watchConnection(ClientConnection & connection) override;
+    void unwatchConnection(ClientConnection & connection) override;
+    OutputQueue * outputQueue(ClientConnection & connection) override;
+    void flush(ClientConnection & connection, OutputQueue & output) override;
+
+    bool supportsMultishotRecv(); // Must be called before anything else is submitted
+    struct io_uring_sqe * getSqe(Operation operation, Server::ConnectionID id = 0);
+    void submitWakeup();
+    void submitAccept(std::size_t listener); // Takes an index into `_listeners`
+    void submitRecv(Server::ConnectionID id, Slot & slot);
+    void submitSend(Server::ConnectionID id, Slot & slot);
+
+    void handleCompletion(struct io_uring_cqe const & cqe);
+    void handleRecv(Server::ConnectionID id, struct io_uring_cqe const & cqe);
+    void handleSend(Server::ConnectionID id, struct io_uring_cqe const & cqe);
+    void releaseSlot(decltype(_slots)::iterator slot); // Called when an operation completes
+};
+
+
+#endif
+
+#endif
@@ -0,0 +1,263 @@
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+
+#include "websocket.hpp"
+
+
+std::string_view const WebSocket::badRequest =
+    "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+
+static std::uint32_t rotateLeft(std::uint32_t value, unsigned bits) {
+    return value << bits | value >> (32 - bits);
+}
+
+// Only used to hash handshake keys, which is why there's no incremental interface
+static std::array<std::uint8_t, 20> sha1(std::string_view data) {
+    std::uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    // Pad to a multiple of 64 bytes, ending with the size in bits
+    std::string message(data);
+    message.push_back('\x80');
+    while (message.size() % 64 != 56) message.push_back('\0');
+    std::uint64_t const bits = std::uint64_t(data.size()) * 8;
+    for (int shift = 56; shift >= 0; shift -= 8) message.push_back(static_cast<char>(bits >> shift));
+
+    for (std::size_t chunk = 0; chunk < message.size(); chunk += 64) {
+        std::uint32_t words[80];
+        for (unsigned i = 0; i < 16; ++i) {
+            auto const * bytes = reinterpret_cast<unsigned char const *>(&message[chunk + i * 4]);
+            words[i] = std::uint32_t(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+        }
+        for (unsigned i = 16; i < 80; ++i) {
+            words[i] = rotateLeft(words[i - 3] ^ words[i - 8] ^ words[i - 14] ^ words[i - 16], 1);
+        }
+
+        std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (unsigned i = 0; i < 80; ++i) {
+            std::uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            std::uint32_t const temp = rotateLeft(a, 5) + f + e + k + words[i];
+            e = d;
+            d = c;
+            c = rotateLeft(b, 30);
+            b = a;
+            a = temp;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+
+    std::array<std::uint8_t, 20> digest;
+    for (unsigned i = 0; i < 20; ++i) digest[i] = state[i / 4] >> (24 - i % 4 * 8);
+    return digest;
+}
+
+static std::string base64(std::uint8_t const * data, std::size_t size) {
+    static char const alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string encoded;
+    encoded.reserve((size + 2) / 3 * 4);
+    for (std::size_t i = 0; i < size; i += 3) {
+        std::uint32_t group = std::uint32_t(data[i]) << 16;
+        if (i + 1 < size) group |= data[i + 1] << 8;
+        if (i + 2 < size) group |= data[i + 2];
+        encoded.push_back(alphabet[group >> 18 & 63]);
+        encoded.push_back(alphabet[group >> 12 & 63]);
+        encoded.push_back(i + 1 < size ? alphabet[group >> 6 & 63] : '=');
+        encoded.push_back(i + 2 < size ? alphabet[group & 63] : '=');
+    }
+    return encoded;
+}
+
+static bool equalsIgnoringCase(std::string_view lhs, std::string_view rhs) {
+    return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](char l, char r){
+        return std::tolower(static_cast<unsigned char>(l)) == std::tolower(static_cast<unsigned char>(r));
+    });
+}
+
+static std::string_view trim(std::string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+    return text;
+}
+
+// Whether the comma-separated list `value` contains `token`, as in "Connection: keep-alive, Upgrade"
+static bool hasToken(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        std::size_t const comma = value.find(',');
+        if (equalsIgnoringCase(trim(value.substr(0, comma)), token)) return true;
+        value.remove_prefix(comma == value.npos ? value.size() : comma + 1);
+    }
+    return false;
+}
+
+
+std::size_t WebSocket::findHandshake(std::string_view data, std::size_t & scanned) {
+    // The terminator may straddle what was already scanned and what was just received
+    std::size_t const end = data.find("\r\n\r\n", scanned < 3 ? 0 : scanned - 3);
+    if (end == data.npos) {
+        scanned = data.size();
+        return 0;
+    }
+    return end + 4;
+}
+
+std::string WebSocket::handshake(std::string_view request) {
+    // The path is ignored, everything is served the same way
+    std::string_view line = request.substr(0, request.find("\r\n"));
+    if (line.substr(0, 4) != "GET " || line.size() < 9 || line.substr(line.size() - 9) != " HTTP/1.1") {
+        throw Error(CloseCode::PROTOCOL_ERROR, "expected a GET request over HTTP/1.1");
+    }
+    request.remove_prefix(line.size() + 2);
+
+    bool upgrade = false, connection = false, version = false;
+    std::string_view key;
+    while (!request.empty()) {
+        line = request.substr(0, request.find("\r\n"));
+        request.remove_prefix(std::min(line.size() + 2, request.size()));
+
+        std::size_t const colon = line.find(':');
+        if (colon == line.npos) continue;
+        std::string_view const name = line.substr(0, colon);
+        std::string_view const value = trim(line.substr(colon + 1));
+        if (equalsIgnoringCase(name, "Upgrade")) {
+            upgrade = equalsIgnoringCase(value, "websocket");
+        } else if (equalsIgnoringCase(name, "Connection")) {
+            connection = hasToken(value, "upgrade");
+        } else if (equalsIgnoringCase(name, "Sec-WebSocket-Version")) {
+            version = value == "13";
+        } else if (equalsIgnoringCase(name, "Sec-WebSocket-Key")) {
+            key = value;
+        }
+    }
+    if (!upgrade || !connection) throw Error(CloseCode::PROTOCOL_ERROR, "not a WebSocket upgrade");
+    if (!version) throw Error(CloseCode::PROTOCOL_ERROR, "unsupported WebSocket version");
+    // The key is 16 random bytes, in base64
+    if (key.size() != 24) throw Error(CloseCode::PROTOCOL_ERROR, "invalid Sec-WebSocket-Key");
+
+    // Proves to the client that we understood the handshake, by hashing its key with a fixed GUID
+    std::string accept(key);
+    accept += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    auto const digest = sha1(accept);
+
+    return "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+           "Sec-WebSocket-Accept: " + base64(digest.data(), digest.size()) + "\r\n\r\n";
+}
+
+
+std::size_t WebSocket::findFrame(char * begin, std::size_t length, Opcode & opcode,
+                                 std::string_view & payload) {
+    payload = std::string_view();
+    if (length < 2) return 0;
+    auto const * bytes = reinterpret_cast<unsigned char const *>(begin);
+
+    bool const fin = bytes[0] & 0x80;
+    if (bytes[0] & 0x70) throw Error(CloseCode::PROTOCOL_ERROR, "reserved bits set");
+    opcode = static_cast<Opcode>(bytes[0] & 0x0F);
+    if (!(bytes[1] & 0x80)) throw Error(CloseCode::PROTOCOL_ERROR, "client frames must be masked");
+
+    // The size takes 7 bits, or the next 2 or 8 bytes if it doesn't fit
+    std::uint64_t size = bytes[1] & 0x7F;
+    std::size_t header = 2;
+    if (size == 126) {
+        header = 4;
+        if (length < header) return 0;
+        size = bytes[2] << 8 | bytes[3];
+    } else if (size == 127) {
+        header = 10;
+        if (length < header) return 0;
+        size = 0;
+        for (unsigned i = 2; i < 10; ++i) size = size << 8 | bytes[i];
+        if (size >> 63) throw Error(CloseCode::PROTOCOL_ERROR, "invalid frame size");
+    }
+    header += 4; // The masking key
+
+    switch (opcode) {
+        case Opcode::TEXT:
+        case Opcode::BINARY:
+            // Browsers never fragment messages, so reassembling them isn't worth the copy
+            if (!fin) throw Error(CloseCode::UNSUPPORTED, "fragmented messages are not supported");
+            break;
+        case Opcode::CONTINUATION:
+            throw Error(CloseCode::UNSUPPORTED, "fragmented messages are not supported");
+        case Opcode::CLOSE:
+        case Opcode::PING:
+        case Opcode::PONG:
+            if (!fin || size > 125) {
+                throw Error(CloseCode::PROTOCOL_ERROR, "control frames must be short and unfragmented");
+            }
+            break;
+        default:
+            throw Error(CloseCode::PROTOCOL_ERROR,
+                        "unknown opcode " + std::to_string(static_cast<unsigned>(opcode)));
+    }
+
+    // The size is known before the payload is there, so oversized messages are caught early
+    payload = std::string_view(begin + std::min(header, length), size);
+    if (length < header || length - header < size) return 0;
+
+    // The key repeats every 4 bytes, so the payload can be unmasked 8 bytes at a time
+    char * data = begin + header;
+    std::uint8_t key[8];
+    std::memcpy(key, data - 4, 4);
+    std::memcpy(key + 4, data - 4, 4);
+    std::uint64_t wideKey;
+    std::memcpy(&wideKey, key, sizeof(wideKey));
+    std::size_t i = 0;
+    for (; i + sizeof(wideKey) <= size; i += sizeof(wideKey)) {
+        std::uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        word ^= wideKey;
+        std::memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < size; ++i) data[i] ^= key[i % 4];
+
+    return header + size;
+}
+
+std::string WebSocket::frame(Opcode opcode, std::string_view payload) {
+    std::string data;
+    data.reserve(10 + payload.size());
+    data.push_back(static_cast<char>(0x80 | static_cast<std::uint8_t>(opcode))); // Always final
+    if (payload.size() < 126) {
+        data.push_back(static_cast<char>(payload.size()));
+    } else if (payload.size() <= 0xFFFF) {
+        data.push_back(126);
+        data.push_back(static_cast<char>(payload.size() >> 8));
+        data.push_back(static_cast<char>(payload.size()));
+    } else {
+        data.push_back(127);
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            data.push_back(static_cast<char>(std::uint64_t(payload.size()) >> shift));
+        }
+    }
+    data.append(payload);
+    return data;
+}
+
+std::string WebSocket::closeFrame(CloseCode code) {
+    char const payload[2] = {
+        static_cast<char>(static_cast<std::uint16_t>(code) >> 8), static_cast<char>(code)
+    };
+    return frame(Opcode::CLOSE, std::string_view(payload, sizeof(payload)));
+}
@@ -0,0 +1,52 @@
+#ifndef WEBSOCKET_HPP
+#define WEBSOCKET_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+
+// The server side of the WebSocket protocol (RFC 6455), as much as musicbotd needs of it
+// This only (de)codes; `ClientConnection` decides what to do with the frames
+class WebSocket {
+public:
+    enum class Opcode : std::uint8_t {
+        CONTINUATION = 0x0, TEXT = 0x1, BINARY = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xA
+    };
+
+    // Status codes sent along with a close frame
+    enum class CloseCode : std::uint16_t {
+        NORMAL = 1000, PROTOCOL_ERROR = 1002, UNSUPPORTED = 1003
+    };
+
+    // Thrown when the client breaks the protocol; `code` is what the connection should be closed with
+    class Error : public std::runtime_error {
+        CloseCode _code;
+    public:
+        Error(CloseCode code, std::string const & what) : std::runtime_error(what), _code(code) {}
+        CloseCode code() const { return _code; }
+    };
+
+    // Sent instead of completing the handshake, if the request isn't a valid upgrade
+    static std::string_view const badRequest;
+
+    // Finds the end of the client's opening handshake (an HTTP request), and returns how many
+    // bytes it spans, or 0 if it's incomplete; the first `scanned` bytes are known not to end it
+    static std::size_t findHandshake(std::string_view data, std::size_t & scanned);
+    // Returns the response completing the handshake; throws `Error` if the request isn't valid
+    static std::string handshake(std::string_view request);
+
+    // Finds the first frame in `[begin, begin + length)`, and returns how many bytes it spans, or 0
+    // if it's incomplete; `payload` is set either way, so its size can be checked
+    // Once complete, the payload is unmasked in place; throws `Error` on protocol violations
+    static std::size_t findFrame(char * begin, std::size_t length, Opcode & opcode,
+                                 std::string_view & payload);
+    // Serializes an unfragmented frame, as sent by a server (i.e. unmasked)
+    static std::string frame(Opcode opcode, std::string_view payload);
+    static std::string closeFrame(CloseCode code);
+};
+
+
+#endif